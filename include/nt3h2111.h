@@ -24,7 +24,14 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <esp_system.h>
+#include <esp_timer.h>
+#include <driver/gpio.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,19 +42,438 @@ extern "C" {
 #define NT3H2111_USERDATA_LEN 884
 // Byte size of device SRAM.
 #define NT3H2111_SRAM_LEN 64
+// Default I2C address of the device.
+#define NT3H2111_DEFAULT_ADDRESS 0x55
+// Value of byte 0 of page 0 when read.
+#define NT3H2111_MANUFACTURER_ID 0x04
+// Byte size of the I2C address space.
+#define NT3H2111_RAW_LEN 4096
+// Worst-case EEPROM programming time in microseconds.
+#define NT3H2111_EEPROM_WRITE_US 5000
+// Default backoff between EEPROM busy polls in microseconds.
+#define NT3H2111_POLL_BACKOFF_US 250
 
+// Number of EEPROM pages covered by the page cache.
+#define NT3H2111_CACHE_PAGES 57
+// Number of latency histogram buckets.
+#define NT3H2111_HIST_BUCKETS 24
+// Byte size of one serialised trace event, excluding the absolute time after an escape.
+#define NT3H2111_TRACE_EVENT_LEN 14
+// Time delta that marks a trace event followed by its 8-byte absolute time.
+#define NT3H2111_TRACE_TIME_ABS 0xffffffffu
+// Block address of the first SRAM page; everything from here on is not EEPROM.
+#define NT3H2111_SRAM_PAGE 0xf8
+// Block address of the session registers.
+#define NT3H2111_SESSION_PAGE 0xfe
+// Block address of the configuration registers.
+#define NT3H2111_CONFIG_PAGE 0x3a
+
+// Register address of NC_REG.
+#define NT3H2111_REG_NC                0
+// Register address of LAST_NDEF_BLOCK.
+#define NT3H2111_REG_LAST_NDEF_BLOCK   1
+// Register address of SRAM_MIRROR_BLOCK.
+#define NT3H2111_REG_SRAM_MIRROR_BLOCK 2
+// Register address of WDT_LS.
+#define NT3H2111_REG_WDT_LS            3
+// Register address of WDT_MS.
+#define NT3H2111_REG_WDT_MS            4
+// Register address of I2C_CLOCK_STR.
+#define NT3H2111_REG_I2C_CLOCK_STR     5
+// Register address of NS_REG in the session registers.
+#define NT3H2111_REG_NS                6
+// Register address of REG_LOCK in the configuration registers.
+#define NT3H2111_REG_LOCK              6
+
+// REG_LOCK: Configuration is permanently locked against NFC writes.
+#define NT3H2111_REG_LOCK_NFC 0x01
+// REG_LOCK: Configuration is permanently locked against I2C writes.
+#define NT3H2111_REG_LOCK_I2C 0x02
+
+// NC_REG: Transfer direction is NFC to I2C.
+#define NT3H2111_NC_TRANSFER_DIR        0x01
+// NC_REG: SRAM mirror enabled.
+#define NT3H2111_NC_SRAM_MIRROR_ON_OFF  0x02
+// NC_REG: Field detect on-condition.
+#define NT3H2111_NC_FD_ON               0x0c
+// NC_REG: Field detect off-condition.
+#define NT3H2111_NC_FD_OFF              0x30
+// NC_REG: Pass-through mode enabled.
+#define NT3H2111_NC_PTHRU_ON_OFF        0x40
+// NC_REG: Soft reset on NFC silence.
+#define NT3H2111_NC_NFCS_I2C_RST_ON_OFF 0x80
+
+// NS_REG: RF field is present.
+#define NT3H2111_NS_RF_FIELD_PRESENT 0x01
+// NS_REG: EEPROM write cycle in progress.
+#define NT3H2111_NS_EEPROM_WR_BUSY   0x02
+// NS_REG: EEPROM write error occurred.
+#define NT3H2111_NS_EEPROM_WR_ERR    0x04
+// NS_REG: SRAM data ready to be read by RF.
+#define NT3H2111_NS_SRAM_RF_READY    0x08
+// NS_REG: SRAM data ready to be read by I2C.
+#define NT3H2111_NS_SRAM_I2C_READY   0x10
+// NS_REG: Memory access is locked to RF.
+#define NT3H2111_NS_RF_LOCKED        0x20
+// NS_REG: Memory access is locked to I2C.
+#define NT3H2111_NS_I2C_LOCKED       0x40
+// NS_REG: Last NDEF block has been read by RF.
+#define NT3H2111_NS_NDEF_DATA_READ   0x80
+
+
+// How to wait for EEPROM writes to complete.
+typedef enum {
+	// Always wait the worst-case EEPROM programming time.
+	NT3H2111_WAIT_FIXED,
+	// Poll EEPROM_WR_BUSY in NS_REG, treating NACKs as busy.
+	NT3H2111_WAIT_POLL,
+} nt3h2111_wait_t;
+
+// What to do when the phone holds the memory.
+typedef enum {
+	// Do not check; errors come straight from the bus.
+	NT3H2111_LOCK_IGNORE,
+	// Fail with ESP_ERR_INVALID_STATE while RF_LOCKED is set.
+	NT3H2111_LOCK_FAIL,
+	// Wait until RF_LOCKED clears.
+	NT3H2111_LOCK_WAIT,
+	// Wait until the RF field is gone.
+	NT3H2111_LOCK_WAIT_FIELD_OFF,
+} nt3h2111_lock_policy_t;
+
+// Write-through shadow of the EEPROM pages.
+typedef struct {
+	// Page contents.
+	uint8_t  pages[NT3H2111_CACHE_PAGES][16];
+	// Bitmask of pages with valid contents.
+	uint64_t valid;
+	// Number of page reads served from the cache.
+	uint32_t hits;
+	// Number of page reads that went to the device.
+	uint32_t misses;
+} nt3h2111_cache_t;
+
+// Write-back buffer for the user data pages.
+typedef struct {
+	// Buffered page contents.
+	uint8_t            pages[NT3H2111_CACHE_PAGES][16];
+	// Bitmask of pages not yet programmed.
+	uint64_t           dirty;
+	// Time without writes after which to flush in microseconds, 0 for explicit flushes only.
+	int64_t            quiet;
+	// Timer that wakes the flush task after the quiet period.
+	esp_timer_handle_t timer;
+	// Device the buffer belongs to.
+	struct NT3H2111   *device;
+	// Task holding the lock, which releases it while blocked on the EEPROM.
+	TaskHandle_t       holder;
+	// Times the holder has taken the lock.
+	UBaseType_t        depth;
+	// Task doing the timed flushes, NULL for explicit flushes only.
+	TaskHandle_t       flush_task;
+	// Tells the flush task to exit.
+	volatile bool      stop;
+	// Given by the flush task when it exits.
+	SemaphoreHandle_t  stopped;
+	// Recursive lock serialising all bus traffic and device state against the flush task.
+	SemaphoreHandle_t  lock;
+} nt3h2111_writeback_t;
+
+// Per-device access statistics.
+typedef struct {
+	// Number of blocks read from the device.
+	uint32_t page_reads;
+	// Number of blocks written to the device.
+	uint32_t page_writes;
+	// Number of EEPROM program cycles started.
+	uint32_t eeprom_writes;
+	// Number of read-modify-write cycles for partially written pages.
+	uint32_t rmw_cycles;
+	// Number of failed I2C transactions, excluding status polls.
+	uint32_t i2c_errors;
+	// Number of NACKed status polls while waiting for a busy EEPROM or a locked tag.
+	uint32_t poll_nacks;
+	// Bytes transferred over I2C, including block and register addresses.
+	uint64_t bytes;
+	// Time spent waiting for EEPROM writes in microseconds.
+	int64_t  wait_time;
+	// Time spent blocked instead of spinning while waiting, in microseconds.
+	int64_t  sleep_time;
+} nt3h2111_stats_t;
+
+// Operations with a latency histogram.
+typedef enum {
+	NT3H2111_OP_GET_NDEF,
+	NT3H2111_OP_SET_NDEF,
+	NT3H2111_OP_READ_PAGE,
+	NT3H2111_OP_WRITE_PAGE,
+	NT3H2111_OP_COUNT,
+} nt3h2111_op_t;
+
+// Latency histogram; bucket n counts latencies below 2^n microseconds not counted by bucket n-1.
+typedef struct {
+	// Log2-spaced latency buckets.
+	uint32_t buckets[NT3H2111_HIST_BUCKETS];
+	// Number of recorded operations.
+	uint32_t count;
+	// Maximum latency in microseconds.
+	int64_t  max;
+} nt3h2111_hist_t;
+
+// One I2C block transfer or session register access, as reported to the trace callback.
+typedef struct {
+	// Start time in microseconds.
+	int64_t   time;
+	// Duration in microseconds.
+	uint32_t  duration;
+	// Result of the transfer.
+	esp_err_t result;
+	// Block address, or register address for session register accesses.
+	uint8_t   page;
+	// Whether this was a write.
+	bool      write;
+	// Whether this was a READ_REGISTER or WRITE_REGISTER command instead of a block transfer.
+	bool      reg;
+} nt3h2111_trace_t;
+
+// Serialises trace events into a buffer.
+typedef struct {
+	// Output buffer.
+	uint8_t *buf;
+	// Capacity of the output buffer.
+	size_t   cap;
+	// Number of bytes written to the output buffer.
+	size_t   len;
+	// Number of events that did not fit.
+	size_t   dropped;
+	// Start time of the last recorded event.
+	int64_t  last_time;
+} nt3h2111_trace_rec_t;
+
+// Direction of pass-through transfers.
+typedef enum {
+	// The host writes the SRAM, the phone reads it.
+	NT3H2111_PTHRU_I2C_TO_NFC,
+	// The phone writes the SRAM, the host reads it.
+	NT3H2111_PTHRU_NFC_TO_I2C,
+} nt3h2111_pthru_dir_t;
+
+// Condition that pulls the field detect pin low.
+typedef enum {
+	// RF field switched on.
+	NT3H2111_FD_ON_FIELD,
+	// First valid start of frame received.
+	NT3H2111_FD_ON_SOF,
+	// Tag selected.
+	NT3H2111_FD_ON_SELECT,
+	// Pass-through SRAM data is ready for the host.
+	NT3H2111_FD_ON_DATA,
+} nt3h2111_fd_on_t;
+
+// Condition that releases the field detect pin.
+typedef enum {
+	// RF field switched off.
+	NT3H2111_FD_OFF_FIELD,
+	// RF field switched off or tag halted.
+	NT3H2111_FD_OFF_HALT,
+	// RF field switched off or last NDEF block read.
+	NT3H2111_FD_OFF_NDEF_READ,
+	// RF field switched off or pass-through SRAM data handled.
+	NT3H2111_FD_OFF_DATA,
+} nt3h2111_fd_off_t;
+
+// Kinds of field detect event.
+typedef enum {
+	// RF field on, or start of frame or selection depending on FD_ON.
+	NT3H2111_EVT_FIELD_ON,
+	// RF field off, or pass-through data handled if FD_OFF selects it.
+	NT3H2111_EVT_FIELD_OFF,
+	// Last NDEF block read by the phone, or RF field off.
+	NT3H2111_EVT_NDEF_READ,
+	// Pass-through SRAM data is ready for the host.
+	NT3H2111_EVT_SRAM_READY,
+} nt3h2111_event_type_t;
+
+// Copy of the session or configuration registers.
+typedef struct {
+	uint8_t nc_reg;
+	uint8_t last_ndef_block;
+	uint8_t sram_mirror_block;
+	uint8_t wdt_ls;
+	uint8_t wdt_ms;
+	uint8_t i2c_clock_str;
+	// NS_REG; only filled in from the session registers.
+	uint8_t ns_reg;
+	// REG_LOCK; only filled in from the configuration registers.
+	uint8_t reg_lock;
+} nt3h2111_regs_t;
+
+struct NT3H2111;
+struct nt3h2111_task;
+
+// Field detect event, as sent to the event queue.
+typedef struct {
+	// Device that raised the event.
+	struct NT3H2111      *device;
+	// Kind of event.
+	nt3h2111_event_type_t type;
+	// Time of the pin change in microseconds.
+	int64_t               time;
+} nt3h2111_event_t;
+
+// Page operation queued on a bus scheduler.
+typedef struct {
+	// Device to access.
+	struct NT3H2111 *device;
+	// Block address.
+	uint8_t          page;
+	// Whether this is a write.
+	bool             write;
+	// Page contents to write.
+	uint8_t          data[16];
+	// Buffer to read into.
+	uint8_t         *out;
+	// Where to store the result, if not NULL.
+	esp_err_t       *result;
+} nt3h2111_sched_op_t;
+
+// Issues queued page operations for several devices on one bus,
+// so that the EEPROM programming time of one device overlaps traffic to others.
+typedef struct {
+	// Queued operations, oldest first.
+	nt3h2111_sched_op_t *ops;
+	// Capacity of the queue.
+	size_t               cap;
+	// Number of queued operations.
+	size_t               len;
+} nt3h2111_sched_t;
+
+// Called for every I2C block transfer and session register access.
+typedef void (*nt3h2111_trace_cb_t)(struct NT3H2111 *device, const nt3h2111_trace_t *event, void *ctx);
+
+// Called when an asynchronous EEPROM write has finished programming.
+typedef void (*nt3h2111_write_cb_t)(struct NT3H2111 *device, void *ctx);
 
 // Info required to interact with the device.
 typedef struct NT3H2111 {
 	int i2c_bus;
 	int i2c_address;
+	// Address programmed into byte 0 of page 0, used from the next power cycle.
+	int next_address;
+	// How to wait for EEPROM writes to complete.
+	nt3h2111_wait_t     wait_mode;
+	// Time between EEPROM busy polls in microseconds.
+	uint32_t            poll_backoff;
+	// Time of the last EEPROM write that may still be in progress, 0 if none.
+	int64_t             last_write_time;
+	// Timer that signals completion of asynchronous writes, created on the first one.
+	esp_timer_handle_t  write_timer;
+	// Completion callback of the pending asynchronous write, if any.
+	nt3h2111_write_cb_t write_cb;
+	// Context for the completion callback.
+	void               *write_cb_ctx;
+	// Optional EEPROM page cache.
+	nt3h2111_cache_t   *cache;
+	// Access statistics.
+	nt3h2111_stats_t    stats;
+	// Optional latency histograms, one per nt3h2111_op_t.
+	nt3h2111_hist_t    *hist;
+	// Optional callback for every I2C block transfer and session register access.
+	nt3h2111_trace_cb_t trace_cb;
+	// Context for the trace callback.
+	void               *trace_ctx;
+	// Field detect pin, or GPIO_NUM_NC if not used.
+	gpio_num_t          fd_pin;
+	// Field detect conditions in NC_REG format.
+	uint8_t             fd_config;
+	// Queue that receives nt3h2111_event_t from the field detect pin.
+	QueueHandle_t       fd_queue;
+	// Set by the field detect pin when a phone may have accessed the tag.
+	volatile bool       fd_field_seen;
+	// What to do when the phone holds the memory.
+	nt3h2111_lock_policy_t lock_policy;
+	// Maximum time to wait for the phone in microseconds, 0 for no limit.
+	int64_t             lock_timeout;
+	// Driver task state, if the driver task is running.
+	struct nt3h2111_task *task;
+	// Optional write-back buffer.
+	nt3h2111_writeback_t *writeback;
+	// Whether waits block instead of spinning.
+	bool                sleep_wait;
+	// Timer that ends blocking waits from its ISR, if supported.
+	esp_timer_handle_t  sleep_timer;
+	// Given by the sleep timer.
+	SemaphoreHandle_t   sleep_sem;
 } NT3H2111;
 
 
 // Initialise the device.
 esp_err_t nt3h2111_init			(NT3H2111 *device, int i2c_bus, int i2c_address);
 // Do some cleanup.
+// Everything is released even on error; a failed final write-back flush is returned and its pages are lost.
 esp_err_t nt3h2111_destroy		(NT3H2111 *device);
+// Select how to wait for EEPROM writes; a backoff of 0 selects the default.
+esp_err_t nt3h2111_set_wait_mode(NT3H2111 *device, nt3h2111_wait_t mode, uint32_t backoff_us);
+// Select whether waits block the task on a one-shot timer instead of spinning,
+// which lets automatic light sleep kick in; time spent blocked is counted in the statistics.
+// The timer uses ESP_TIMER_ISR dispatch if CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD is set,
+// so waits also work from esp_timer callbacks; otherwise waits block for whole ticks and spin the rest.
+esp_err_t nt3h2111_set_sleep_wait(NT3H2111 *device, bool enable);
+
+// Select what to do when the phone holds the memory; checked once per access through NS_REG.
+// While waiting, NS_REG is polled every poll backoff; a NACK counts as locked.
+// A timeout of 0 waits forever; waits that time out return ESP_ERR_TIMEOUT.
+esp_err_t nt3h2111_set_lock_policy(NT3H2111 *device, nt3h2111_lock_policy_t policy, int64_t timeout_us);
+
+// Enable or disable the EEPROM page cache.
+// While enabled, each access first checks NS_REG and drops the cache if an RF field is present.
+// RF_FIELD_PRESENT does not latch, so this misses a phone that came and went between accesses;
+// the cache is only coherent with RF writes when the field detect pin is used (nt3h2111_fd_start).
+esp_err_t nt3h2111_cache_enable	(NT3H2111 *device, bool enable);
+// Drop all cached pages, e.g. after the tag was written over RF.
+void      nt3h2111_cache_invalidate(NT3H2111 *device);
+
+// Enable write-back buffering: writes to user data pages only land in RAM and are programmed
+// once no writes happened for `quiet_us`, on nt3h2111_flush, or when disabled.
+// Timed flushes run in a task of the given priority, so the esp_timer task never touches the bus.
+// While enabled, every bus transaction on the device takes one per-device lock, so other tasks may keep using it.
+// Do not enable or disable it while another task is using the device.
+// With a field detect pin on NT3H2111_FD_ON_FIELD, timed flushes wait for the phone to leave;
+// otherwise, call nt3h2111_flush on NT3H2111_EVT_FIELD_OFF to flush at field-off.
+esp_err_t nt3h2111_writeback_enable(NT3H2111 *device, int64_t quiet_us, UBaseType_t priority);
+// Flush and disable write-back buffering.
+esp_err_t nt3h2111_writeback_disable(NT3H2111 *device);
+// Program all dirty pages of the write-back buffer.
+esp_err_t nt3h2111_flush		(NT3H2111 *device);
+
+// Get access statistics, optionally resetting them afterwards.
+esp_err_t nt3h2111_get_stats	(NT3H2111 *device, nt3h2111_stats_t *stats, bool reset);
+// Enable or disable latency histograms; enabling again resets them.
+esp_err_t nt3h2111_hist_enable	(NT3H2111 *device, bool enable);
+// Get an upper bound in microseconds on the given percentile, in tenths of a percent.
+int64_t   nt3h2111_hist_percentile(const nt3h2111_hist_t *hist, uint32_t permille);
+// Format the latency histograms as text, one line per operation.
+// Returns the length the full text would have, like snprintf.
+size_t    nt3h2111_hist_dump	(NT3H2111 *device, char *buf, size_t cap);
+// Set or clear the callback for every I2C block transfer and session register access.
+esp_err_t nt3h2111_set_trace	(NT3H2111 *device, nt3h2111_trace_cb_t cb, void *ctx);
+// Initialise a trace recorder writing into `buf`.
+void      nt3h2111_trace_rec_init(nt3h2111_trace_rec_t *rec, uint8_t *buf, size_t cap);
+// Trace callback that serialises events; pass an nt3h2111_trace_rec_t as `ctx`.
+void      nt3h2111_trace_record	(NT3H2111 *device, const nt3h2111_trace_t *event, void *ctx);
+// Decode the next event from a recorded trace, for replaying it elsewhere.
+// `pos` is the read position, initially 0, and `time` the start time of the previous event.
+// The first event carries its absolute time, so `time` need not be initialised.
+// Returns ESP_ERR_NOT_FOUND at the end of the trace.
+esp_err_t nt3h2111_trace_next	(const uint8_t *buf, size_t len, size_t *pos, int64_t *time, nt3h2111_trace_t *event);
+// Change the I2C address of the device by writing byte 0 of page 0.
+// The device keeps answering at the old address until the next power cycle.
+esp_err_t nt3h2111_set_address	(NT3H2111 *device, int i2c_address);
+// Scan addresses `first` to `last` inclusive for devices and initialise a handle for each, ordered by serial number.
+// Each address is first probed with a read-only transaction; only addresses that acknowledge get a block 0 read,
+// which writes the block address, so leave out addresses of other devices that treat a written byte as a command.
+// Stores the number of devices found in `found`, which may exceed `cap`; only `cap` handles are initialised.
+esp_err_t nt3h2111_discover		(int i2c_bus, int first, int last, NT3H2111 devices[], size_t cap, size_t *found);
 
 // Get device serial number.
 esp_err_t nt3h2111_get_serial	(NT3H2111 *device, uint64_t *serial);
@@ -57,27 +483,110 @@ esp_err_t nt3h2111_get_cc		(NT3H2111 *device, uint32_t *cc);
 esp_err_t nt3h2111_set_cc		(NT3H2111 *device, uint32_t cc);
 // Get NDEF encoded NDEF data.
 esp_err_t nt3h2111_get_ndef		(NT3H2111 *device, size_t *len, uint8_t **data);
+// Get NDEF encoded NDEF data into a caller-provided buffer without allocating.
+// Always stores the message length in `len`; returns ESP_ERR_NO_MEM if it exceeds `cap`.
+esp_err_t nt3h2111_read_ndef	(NT3H2111 *device, size_t cap, uint8_t data[], size_t *len);
 // Set NDEF encoded NDEF data.
 esp_err_t nt3h2111_set_ndef		(NT3H2111 *device, size_t len, const uint8_t data[]);
+// Set NDEF encoded NDEF data, only programming pages whose contents differ.
+// Stores the number of pages programmed in `written` if not NULL.
+esp_err_t nt3h2111_set_ndef_diff(NT3H2111 *device, size_t len, const uint8_t data[], size_t *written);
 
 // Read user data EEPROM.
-esp_err_t nt3h2111_read_user	(NT3H2111 *device, uint16_t offset, uint8_t len, uint8_t data[]);
+esp_err_t nt3h2111_read_user	(NT3H2111 *device, uint16_t offset, uint16_t len, uint8_t data[]);
 // Write user data EEPROM.
-esp_err_t nt3h2111_write_user	(NT3H2111 *device, uint16_t offset, uint8_t len, const uint8_t data[]);
+esp_err_t nt3h2111_write_user	(NT3H2111 *device, uint16_t offset, uint16_t len, const uint8_t data[]);
 // Read SRAM.
 esp_err_t nt3h2111_read_sram	(NT3H2111 *device, uint8_t offset,  uint8_t len, uint8_t data[]);
 // Write SRAM.
 esp_err_t nt3h2111_write_sram	(NT3H2111 *device, uint8_t offset,  uint8_t len, const uint8_t data[]);
 
 // Unaligned raw read.
-esp_err_t nt3h2111_read_raw		(NT3H2111 *device, uint8_t offset,  uint8_t len, uint8_t data[]);
+esp_err_t nt3h2111_read_raw		(NT3H2111 *device, uint16_t offset, uint16_t len, uint8_t data[]);
 // Unaligned raw write.
-esp_err_t nt3h2111_write_raw	(NT3H2111 *device, uint8_t offset,  uint8_t len, const uint8_t data[]);
+esp_err_t nt3h2111_write_raw	(NT3H2111 *device, uint16_t offset, uint16_t len, const uint8_t data[]);
+// Unaligned raw write that only programs pages whose contents differ.
+// Stores the number of pages programmed in `written` if not NULL.
+esp_err_t nt3h2111_write_raw_diff(NT3H2111 *device, uint16_t offset, uint16_t len, const uint8_t data[], size_t *written);
 // Page-aligned raw read.
 esp_err_t nt3h2111_read_page	(NT3H2111 *device, uint8_t page,    uint8_t data[16]);
 // Page-aligned raw write.
 esp_err_t nt3h2111_write_page	(NT3H2111 *device, uint8_t page,    const uint8_t data[16]);
 
+// Read a session register.
+esp_err_t nt3h2111_read_reg		(NT3H2111 *device, uint8_t reg, uint8_t *value);
+// Write the bits selected by `mask` of a session register in one transaction.
+esp_err_t nt3h2111_write_reg	(NT3H2111 *device, uint8_t reg, uint8_t mask, uint8_t value);
+// Set bits of a session register in one transaction.
+esp_err_t nt3h2111_set_reg_bits	(NT3H2111 *device, uint8_t reg, uint8_t bits);
+// Clear bits of a session register in one transaction.
+esp_err_t nt3h2111_clear_reg_bits(NT3H2111 *device, uint8_t reg, uint8_t bits);
+// Read all session registers.
+esp_err_t nt3h2111_get_session_regs(NT3H2111 *device, nt3h2111_regs_t *regs);
+// Read all configuration registers in one block read.
+esp_err_t nt3h2111_get_config_regs(NT3H2111 *device, nt3h2111_regs_t *regs);
+// Write all configuration registers to EEPROM; they are loaded into the session registers at power-on.
+// Neither `ns_reg` nor `reg_lock` is written; REG_LOCK keeps its current value.
+esp_err_t nt3h2111_set_config_regs(NT3H2111 *device, const nt3h2111_regs_t *regs);
+// Set bits in REG_LOCK, which PERMANENTLY locks the configuration registers.
+esp_err_t nt3h2111_lock_config	(NT3H2111 *device, uint8_t bits);
+
+// Configure the field detect conditions and report pin changes as nt3h2111_event_t to `queue`, which is required.
+// The pin is open-drain and gets the internal pull-up; the GPIO ISR service is installed if needed.
+esp_err_t nt3h2111_fd_start		(NT3H2111 *device, gpio_num_t pin, nt3h2111_fd_on_t on, nt3h2111_fd_off_t off, QueueHandle_t queue);
+// Stop reporting field detect events.
+esp_err_t nt3h2111_fd_stop		(NT3H2111 *device);
+
+// Show the SRAM to the phone at the given user data offset instead of the EEPROM there.
+// The offset must be 16-byte aligned; cannot be combined with pass-through mode.
+esp_err_t nt3h2111_sram_mirror_start(NT3H2111 *device, uint16_t offset);
+// Stop showing the SRAM to the phone.
+esp_err_t nt3h2111_sram_mirror_stop(NT3H2111 *device);
+
+// Enable pass-through mode in the given direction; requires an RF field.
+esp_err_t nt3h2111_pthru_start	(NT3H2111 *device, nt3h2111_pthru_dir_t dir);
+// Disable pass-through mode.
+esp_err_t nt3h2111_pthru_stop	(NT3H2111 *device);
+// Send data to the phone through the SRAM in 64-byte frames; the last frame is zero-padded.
+// Each frame waits at most `timeout_us` for the phone; returns ESP_ERR_INVALID_STATE if the field is lost.
+esp_err_t nt3h2111_pthru_send	(NT3H2111 *device, size_t len, const uint8_t data[], int64_t timeout_us);
+// Receive data from the phone through the SRAM in 64-byte frames; excess bytes of the last frame are dropped.
+// Each frame waits at most `timeout_us` for the phone; returns ESP_ERR_INVALID_STATE if the field is lost.
+esp_err_t nt3h2111_pthru_recv	(NT3H2111 *device, size_t len, uint8_t data[], int64_t timeout_us);
+
+// Page-aligned raw write that returns without waiting for the EEPROM.
+// The callback runs from the esp_timer task after the worst-case programming time,
+// without touching the bus, so it does not race with the calling task.
+// Returns ESP_ERR_INVALID_STATE if a previous write is still in progress.
+esp_err_t nt3h2111_write_page_async(NT3H2111 *device, uint8_t page, const uint8_t data[16], nt3h2111_write_cb_t cb, void *ctx);
+// Whether an EEPROM write is still in progress.
+bool      nt3h2111_is_busy		(NT3H2111 *device);
+
+// Start a driver task that owns the device and serves nt3h2111_task_read and nt3h2111_task_write.
+// Writes queued together are merged so that every page they touch is programmed once.
+// While the task runs, other functions must not be called on the device.
+esp_err_t nt3h2111_task_start	(NT3H2111 *device, UBaseType_t priority, size_t queue_len);
+// Stop the driver task after it has served the requests queued before this call.
+// Requests made later fail with ESP_ERR_INVALID_STATE; the queue is freed once no caller uses it.
+esp_err_t nt3h2111_task_stop	(NT3H2111 *device);
+// Unaligned raw read through the driver task; blocks on a semaphore private to the request.
+// `timeout` only limits the wait for space in the queue.
+esp_err_t nt3h2111_task_read	(NT3H2111 *device, uint16_t offset, uint16_t len, uint8_t data[], TickType_t timeout);
+// Unaligned raw write through the driver task; blocks on a semaphore private to the request.
+// `timeout` only limits the wait for space in the queue.
+esp_err_t nt3h2111_task_write	(NT3H2111 *device, uint16_t offset, uint16_t len, const uint8_t data[], TickType_t timeout);
+
+// Initialise a bus scheduler using caller-provided queue storage.
+void      nt3h2111_sched_init	(nt3h2111_sched_t *sched, nt3h2111_sched_op_t *ops, size_t cap);
+// Queue a page write; returns ESP_ERR_NO_MEM if the queue is full.
+esp_err_t nt3h2111_sched_write	(nt3h2111_sched_t *sched, NT3H2111 *device, uint8_t page, const uint8_t data[16], esp_err_t *result);
+// Queue a page read; returns ESP_ERR_NO_MEM if the queue is full.
+esp_err_t nt3h2111_sched_read	(nt3h2111_sched_t *sched, NT3H2111 *device, uint8_t page, uint8_t data[16], esp_err_t *result);
+// Run queued operations until the queue is empty, issuing each device's operations in order
+// to whichever devices are not busy programming their EEPROM.
+// Returns the first error encountered, but runs all operations regardless.
+esp_err_t nt3h2111_sched_run	(nt3h2111_sched_t *sched);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
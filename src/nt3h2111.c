@@ -24,11 +24,18 @@
 
 // Note: NT3H2111 is a little-endian device.
 
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <sdkconfig.h>
 #include <esp_log.h>
 #include <esp_timer.h>
 #include <driver/gpio.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
 #include "nt3h2111.h"
 #include "managed_i2c.h"
 
@@ -40,7 +47,7 @@
 	static inline type read_uint##bits(const uint8_t *ptr) { \
 		type out = 0; \
 		for (size_t i = 0; i < bits/8; i++) { \
-			out |= ptr[i] << (i*8); \
+			out |= (type) ptr[i] << (i*8); \
 		} \
 		return out; \
 	} \
@@ -54,28 +61,517 @@
 GEN_RW_UINT(16, uint16_t)
 GEN_RW_UINT(24, uint32_t)
 GEN_RW_UINT(32, uint32_t)
-GEN_RW_UINT(40, uint32_t)
-GEN_RW_UINT(48, uint32_t)
-GEN_RW_UINT(56, uint32_t)
-GEN_RW_UINT(64, uint32_t)
+GEN_RW_UINT(40, uint64_t)
+GEN_RW_UINT(48, uint64_t)
+GEN_RW_UINT(56, uint64_t)
+GEN_RW_UINT(64, uint64_t)
 
 
 
+// Serialise bus traffic and device state against the write-back flush task; a no-op without write-back.
+// The lock is recursive, and released while its holder blocks in nt3h2111_sleep_until.
+static nt3h2111_writeback_t *nt3h2111_lock(NT3H2111 *device) {
+	nt3h2111_writeback_t *wb = device->writeback;
+	if (!wb) return NULL;
+	xSemaphoreTakeRecursive(wb->lock, portMAX_DELAY);
+	wb->holder = xTaskGetCurrentTaskHandle();
+	wb->depth++;
+	return wb;
+}
+
+// Release the lock taken by nt3h2111_lock.
+static void nt3h2111_unlock(nt3h2111_writeback_t *wb) {
+	if (!wb) return;
+	if (!--wb->depth) wb->holder = NULL;
+	xSemaphoreGiveRecursive(wb->lock);
+}
+
+
+
+// All bus traffic goes through these so there is one place to substitute or observe it.
+
+// Count a finished I2C transaction.
+static inline esp_err_t nt3h2111_count(NT3H2111 *device, esp_err_t res, size_t bytes) {
+	if (res) {
+		device->stats.i2c_errors++;
+	} else {
+		device->stats.bytes += bytes;
+	}
+	return res;
+}
+
+// Count a finished status poll, where a NACK is expected while the device is busy or locked.
+static inline esp_err_t nt3h2111_count_poll(NT3H2111 *device, esp_err_t res, size_t bytes) {
+	if (res) {
+		device->stats.poll_nacks++;
+	} else {
+		device->stats.bytes += bytes;
+	}
+	return res;
+}
+
+// Report a finished transfer to the trace callback.
+static void nt3h2111_trace(NT3H2111 *device, uint8_t page, bool write, bool reg, int64_t start, esp_err_t res) {
+	if (!device->trace_cb) return;
+	nt3h2111_trace_t event = {
+		.time     = start,
+		.duration = esp_timer_get_time() - start,
+		.result   = res,
+		.page     = page,
+		.write    = write,
+		.reg      = reg,
+	};
+	device->trace_cb(device, &event, device->trace_ctx);
+}
+
+// Read a block using the normal memory read.
+static esp_err_t nt3h2111_bus_read(NT3H2111 *device, uint8_t page, uint8_t data[16]) {
+	nt3h2111_writeback_t *wb    = nt3h2111_lock(device);
+	int64_t               start = esp_timer_get_time();
+	device->stats.page_reads++;
+	esp_err_t res = i2c_read_reg(device->i2c_bus, device->i2c_address, page, data, 16);
+	nt3h2111_trace(device, page, false, false, start, res);
+	nt3h2111_count(device, res, 17);
+	nt3h2111_unlock(wb);
+	return res;
+}
+
+// Write a block using the normal memory write.
+static esp_err_t nt3h2111_bus_write(NT3H2111 *device, uint8_t page, const uint8_t data[16]) {
+	nt3h2111_writeback_t *wb    = nt3h2111_lock(device);
+	int64_t               start = esp_timer_get_time();
+	device->stats.page_writes++;
+	esp_err_t res = i2c_write_reg_n(device->i2c_bus, device->i2c_address, page, data, 16);
+	nt3h2111_trace(device, page, true, false, start, res);
+	nt3h2111_count(device, res, 17);
+	nt3h2111_unlock(wb);
+	return res;
+}
+
+// Send a READ_REGISTER command; both of its transactions are traced as one event.
+static esp_err_t nt3h2111_session_read(NT3H2111 *device, uint8_t reg, uint8_t *value, bool poll) {
+	// Nothing may come between the two transactions.
+	nt3h2111_writeback_t *wb    = nt3h2111_lock(device);
+	int64_t               start = esp_timer_get_time();
+	size_t                bytes = 2;
+	esp_err_t             res   = i2c_write_reg(device->i2c_bus, device->i2c_address, NT3H2111_SESSION_PAGE, reg);
+	if (!res) {
+		res    = i2c_read_bytes(device->i2c_bus, device->i2c_address, value, 1);
+		bytes += 1;
+	}
+	nt3h2111_trace(device, reg, false, true, start, res);
+	if (poll) {
+		nt3h2111_count_poll(device, res, bytes);
+	} else {
+		nt3h2111_count(device, res, bytes);
+	}
+	nt3h2111_unlock(wb);
+	return res;
+}
+
+// Read a session register using the READ_REGISTER command.
+static esp_err_t nt3h2111_read_session(NT3H2111 *device, uint8_t reg, uint8_t *value) {
+	return nt3h2111_session_read(device, reg, value, false);
+}
+
+// Read a session register while polling for the device to become ready.
+static esp_err_t nt3h2111_poll_session(NT3H2111 *device, uint8_t reg, uint8_t *value) {
+	return nt3h2111_session_read(device, reg, value, true);
+}
+
+// Write the bits selected by `mask` of a session register using the WRITE_REGISTER command.
+static esp_err_t nt3h2111_write_session(NT3H2111 *device, uint8_t reg, uint8_t mask, uint8_t value) {
+	nt3h2111_writeback_t *wb     = nt3h2111_lock(device);
+	int64_t               start  = esp_timer_get_time();
+	uint8_t               tmp[3] = { reg, mask, value };
+	esp_err_t             res    = i2c_write_reg_n(device->i2c_bus, device->i2c_address, NT3H2111_SESSION_PAGE, tmp, 3);
+	nt3h2111_trace(device, reg, true, true, start, res);
+	nt3h2111_count(device, res, 4);
+	nt3h2111_unlock(wb);
+	return res;
+}
+
+
+static void nt3h2111_write_timer_cb(void *arg);
+#if CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+static void nt3h2111_sleep_timer_cb(void *arg);
+#endif
+static esp_err_t nt3h2111_arbitrate(NT3H2111 *device);
+static esp_err_t nt3h2111_page_read(NT3H2111 *device, uint8_t page, uint8_t data[16]);
+static esp_err_t nt3h2111_page_write(NT3H2111 *device, uint8_t page, const uint8_t data[16]);
+static esp_err_t nt3h2111_write_part(NT3H2111 *device, uint8_t page, size_t misalign, size_t wlen, const uint8_t data[], bool diff, size_t *written);
+static esp_err_t nt3h2111_writeback_disable_ex(NT3H2111 *device, bool force);
+
 // Initialise the device.
 esp_err_t nt3h2111_init(NT3H2111 *device, int i2c_bus, int i2c_address) {
-	device->i2c_bus     = i2c_bus;
-	device->i2c_address = i2c_address;
+	device->i2c_bus         = i2c_bus;
+	device->i2c_address     = i2c_address;
+	device->next_address    = i2c_address;
+	device->wait_mode       = NT3H2111_WAIT_FIXED;
+	device->poll_backoff    = NT3H2111_POLL_BACKOFF_US;
+	device->last_write_time = 0;
+	device->write_timer     = NULL;
+	device->write_cb        = NULL;
+	device->write_cb_ctx    = NULL;
+	device->cache           = NULL;
+	memset(&device->stats, 0, sizeof(device->stats));
+	device->hist            = NULL;
+	device->trace_cb        = NULL;
+	device->trace_ctx       = NULL;
+	device->fd_pin          = GPIO_NUM_NC;
+	device->fd_config       = 0;
+	device->fd_queue        = NULL;
+	device->fd_field_seen   = false;
+	device->lock_policy     = NT3H2111_LOCK_IGNORE;
+	device->lock_timeout    = 0;
+	device->task            = NULL;
+	device->writeback       = NULL;
+	device->sleep_wait      = false;
+	device->sleep_timer     = NULL;
+	device->sleep_sem       = NULL;
 	return ESP_OK;
 }
 
 // Do some cleanup.
 esp_err_t nt3h2111_destroy(NT3H2111 *device) {
-	// No-op function.
+	nt3h2111_task_stop(device);
+	// The buffer goes away even if the final flush fails; that error is still reported.
+	esp_err_t res = nt3h2111_writeback_disable_ex(device, true);
+	nt3h2111_fd_stop(device);
+	nt3h2111_set_sleep_wait(device, false);
+	if (device->write_timer) {
+		esp_timer_stop(device->write_timer);
+		esp_err_t timer_res = esp_timer_delete(device->write_timer);
+		if (!res) res = timer_res;
+	}
+	device->write_timer = NULL;
+	device->write_cb    = NULL;
+	nt3h2111_cache_enable(device, false);
+	nt3h2111_hist_enable(device, false);
+	return res;
+}
+
+// Select whether waits block on a timer instead of spinning.
+esp_err_t nt3h2111_set_sleep_wait(NT3H2111 *device, bool enable) {
+	if (!enable) {
+		if (device->sleep_timer) {
+			esp_timer_stop(device->sleep_timer);
+			esp_timer_delete(device->sleep_timer);
+			vSemaphoreDelete(device->sleep_sem);
+		}
+		device->sleep_wait  = false;
+		device->sleep_timer = NULL;
+		device->sleep_sem   = NULL;
+		return ESP_OK;
+	}
+	if (device->sleep_wait) return ESP_OK;
+	
+#if CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+	// Create the wake-up semaphore.
+	device->sleep_sem = xSemaphoreCreateBinary();
+	if (!device->sleep_sem) {
+		return ESP_ERR_NO_MEM;
+	}
+	
+	// Create the wake-up timer; it fires from the ISR so it never waits for the esp_timer task.
+	esp_timer_create_args_t timer_args = {
+		.callback        = nt3h2111_sleep_timer_cb,
+		.arg             = device,
+		.dispatch_method = ESP_TIMER_ISR,
+		.name            = "nt3h2111_sleep",
+	};
+	esp_err_t res = esp_timer_create(&timer_args, &device->sleep_timer);
+	if (res) {
+		vSemaphoreDelete(device->sleep_sem);
+		device->sleep_sem   = NULL;
+		device->sleep_timer = NULL;
+		return res;
+	}
+#endif
+	
+	device->sleep_wait = true;
+	return ESP_OK;
+}
+
+// Select how to wait for EEPROM writes; a backoff of 0 selects the default.
+esp_err_t nt3h2111_set_wait_mode(NT3H2111 *device, nt3h2111_wait_t mode, uint32_t backoff_us) {
+	if (mode != NT3H2111_WAIT_FIXED && mode != NT3H2111_WAIT_POLL) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	device->wait_mode    = mode;
+	device->poll_backoff = backoff_us ? backoff_us : NT3H2111_POLL_BACKOFF_US;
+	return ESP_OK;
+}
+
+
+// Enable or disable the EEPROM page cache.
+esp_err_t nt3h2111_cache_enable(NT3H2111 *device, bool enable) {
+	nt3h2111_writeback_t *wb  = nt3h2111_lock(device);
+	esp_err_t             res = ESP_OK;
+	if (!enable) {
+		free(device->cache);
+		device->cache = NULL;
+	} else if (!device->cache) {
+		device->cache = calloc(1, sizeof(nt3h2111_cache_t));
+		if (!device->cache) res = ESP_ERR_NO_MEM;
+	}
+	nt3h2111_unlock(wb);
+	return res;
+}
+
+// Drop all cached pages, e.g. after the tag was written over RF.
+void nt3h2111_cache_invalidate(NT3H2111 *device) {
+	nt3h2111_writeback_t *wb = nt3h2111_lock(device);
+	if (device->cache) device->cache->valid = 0;
+	nt3h2111_unlock(wb);
+}
+
+
+// Get access statistics, optionally resetting them afterwards.
+esp_err_t nt3h2111_get_stats(NT3H2111 *device, nt3h2111_stats_t *stats, bool reset) {
+	nt3h2111_writeback_t *wb = nt3h2111_lock(device);
+	if (stats) *stats = device->stats;
+	if (reset) memset(&device->stats, 0, sizeof(device->stats));
+	nt3h2111_unlock(wb);
+	return ESP_OK;
+}
+
+
+// Enable or disable latency histograms; enabling again resets them.
+esp_err_t nt3h2111_hist_enable(NT3H2111 *device, bool enable) {
+	nt3h2111_writeback_t *wb = nt3h2111_lock(device);
+	free(device->hist);
+	device->hist = enable ? calloc(NT3H2111_OP_COUNT, sizeof(nt3h2111_hist_t)) : NULL;
+	esp_err_t res = enable && !device->hist ? ESP_ERR_NO_MEM : ESP_OK;
+	nt3h2111_unlock(wb);
+	return res;
+}
+
+// Record the latency of an operation that started at `start`.
+static void nt3h2111_hist_add(NT3H2111 *device, nt3h2111_op_t op, int64_t start) {
+	if (!device->hist) return;
+	nt3h2111_hist_t *hist    = &device->hist[op];
+	int64_t          latency = esp_timer_get_time() - start;
+	
+	// Bucket n holds latencies of n significant bits.
+	size_t bucket = latency > 0 ? 64 - __builtin_clzll(latency) : 0;
+	if (bucket >= NT3H2111_HIST_BUCKETS) bucket = NT3H2111_HIST_BUCKETS - 1;
+	hist->buckets[bucket]++;
+	hist->count++;
+	if (latency > hist->max) hist->max = latency;
+}
+
+// Get an upper bound in microseconds on the given percentile, in tenths of a percent.
+int64_t nt3h2111_hist_percentile(const nt3h2111_hist_t *hist, uint32_t permille) {
+	// Number of samples at or below the percentile.
+	uint64_t target = ((uint64_t) hist->count * permille + 999) / 1000;
+	uint64_t seen   = 0;
+	for (size_t i = 0; i < NT3H2111_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target && seen) {
+			// Upper bound of the bucket, but never more than the maximum.
+			int64_t bound = (1ll << i) - 1;
+			return bound < hist->max ? bound : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+// Append formatted text to a buffer, counting the full length like snprintf.
+static void nt3h2111_append(char *buf, size_t cap, size_t *total, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	size_t off = *total < cap ? *total : cap;
+	int    len = vsnprintf(buf + off, cap - off, fmt, args);
+	va_end(args);
+	if (len > 0) *total += len;
+}
+
+// Format the latency histograms as text, one line per operation.
+size_t nt3h2111_hist_dump(NT3H2111 *device, char *buf, size_t cap) {
+	static const char *const names[NT3H2111_OP_COUNT] = {
+		"get_ndef", "set_ndef", "read_page", "write_page",
+	};
+	size_t total = 0;
+	if (cap) *buf = 0;
+	nt3h2111_writeback_t *wb = nt3h2111_lock(device);
+	if (!device->hist) {
+		nt3h2111_unlock(wb);
+		return 0;
+	}
+	
+	for (size_t op = 0; op < NT3H2111_OP_COUNT; op++) {
+		const nt3h2111_hist_t *hist = &device->hist[op];
+		nt3h2111_append(
+			buf, cap, &total, "%s n=%"PRIu32" p50=%"PRId64" p99=%"PRId64" max=%"PRId64" us",
+			names[op], hist->count,
+			nt3h2111_hist_percentile(hist, 500), nt3h2111_hist_percentile(hist, 990), hist->max
+		);
+		for (size_t i = 0; i < NT3H2111_HIST_BUCKETS; i++) {
+			nt3h2111_append(buf, cap, &total, "%c%"PRIu32, i ? ',' : ' ', hist->buckets[i]);
+		}
+		nt3h2111_append(buf, cap, &total, "\n");
+	}
+	nt3h2111_unlock(wb);
+	return total;
+}
+
+
+// Set or clear the callback for every I2C block transfer.
+esp_err_t nt3h2111_set_trace(NT3H2111 *device, nt3h2111_trace_cb_t cb, void *ctx) {
+	nt3h2111_writeback_t *wb = nt3h2111_lock(device);
+	device->trace_cb  = cb;
+	device->trace_ctx = ctx;
+	nt3h2111_unlock(wb);
+	return ESP_OK;
+}
+
+// Initialise a trace recorder writing into `buf`.
+void nt3h2111_trace_rec_init(nt3h2111_trace_rec_t *rec, uint8_t *buf, size_t cap) {
+	rec->buf       = buf;
+	rec->cap       = cap;
+	rec->len       = 0;
+	rec->dropped   = 0;
+	rec->last_time = 0;
+}
+
+// Trace callback that serialises events; pass an nt3h2111_trace_rec_t as `ctx`.
+// Each event is stored little-endian as: time since previous event (4 bytes),
+// duration (4 bytes), result (4 bytes), block or register address (1 byte),
+// flags (1 byte: bit 0 write, bit 1 register access).
+// The first event and any event after a gap that does not fit store the escape
+// value NT3H2111_TRACE_TIME_ABS as time, followed by the absolute time (8 bytes).
+void nt3h2111_trace_record(NT3H2111 *device, const nt3h2111_trace_t *event, void *ctx) {
 	(void) device;
+	nt3h2111_trace_rec_t *rec    = ctx;
+	int64_t               delta  = event->time - rec->last_time;
+	bool                  escape = !rec->len || delta < 0 || delta >= NT3H2111_TRACE_TIME_ABS;
+	size_t                len    = NT3H2111_TRACE_EVENT_LEN + (escape ? 8 : 0);
+	if (rec->cap - rec->len < len) {
+		rec->dropped++;
+		return;
+	}
+	
+	uint8_t *ptr = rec->buf + rec->len;
+	write_uint32(escape ? NT3H2111_TRACE_TIME_ABS : delta, ptr + 0);
+	write_uint32(event->duration,                          ptr + 4);
+	write_uint32(event->result,                            ptr + 8);
+	ptr[12] = event->page;
+	ptr[13] = event->write | (event->reg << 1);
+	if (escape) write_uint64(event->time, ptr + NT3H2111_TRACE_EVENT_LEN);
+	rec->last_time  = event->time;
+	rec->len       += len;
+}
+
+// Decode the next event from a recorded trace, for replaying it elsewhere.
+esp_err_t nt3h2111_trace_next(const uint8_t *buf, size_t len, size_t *pos, int64_t *time, nt3h2111_trace_t *event) {
+	if (*pos + NT3H2111_TRACE_EVENT_LEN > len) {
+		return ESP_ERR_NOT_FOUND;
+	}
+	
+	// Large gaps are followed by the absolute time.
+	const uint8_t *ptr   = buf + *pos;
+	uint32_t       delta = read_uint32(ptr + 0);
+	if (delta == NT3H2111_TRACE_TIME_ABS) {
+		if (*pos + NT3H2111_TRACE_EVENT_LEN + 8 > len) {
+			return ESP_ERR_NOT_FOUND;
+		}
+		*time  = (int64_t) read_uint64(ptr + NT3H2111_TRACE_EVENT_LEN);
+		*pos  += 8;
+	} else {
+		*time += delta;
+	}
+	event->time      = *time;
+	event->duration  = read_uint32(ptr + 4);
+	event->result    = (esp_err_t) read_uint32(ptr + 8);
+	event->page      = ptr[12];
+	event->write     = ptr[13] & 1;
+	event->reg       = (ptr[13] >> 1) & 1;
+	*pos            += NT3H2111_TRACE_EVENT_LEN;
+	return ESP_OK;
+}
+
+
+// Select what to do when the phone holds the memory.
+esp_err_t nt3h2111_set_lock_policy(NT3H2111 *device, nt3h2111_lock_policy_t policy, int64_t timeout_us) {
+	if (policy > NT3H2111_LOCK_WAIT_FIELD_OFF || timeout_us < 0) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	device->lock_policy  = policy;
+	device->lock_timeout = timeout_us;
 	return ESP_OK;
 }
 
 
+// Change the I2C address of the device; takes effect after the next power cycle.
+esp_err_t nt3h2111_set_address(NT3H2111 *device, int i2c_address) {
+	if (i2c_address < 0x08 || i2c_address > 0x77) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	
+	// Keep the rest of page 0 as it is.
+	uint8_t   tmp[16];
+	esp_err_t res = nt3h2111_read_page(device, 0, tmp);
+	if (res) return res;
+	tmp[0] = i2c_address << 1;
+	res    = nt3h2111_write_page(device, 0, tmp);
+	
+	// Later writes to page 0 must keep the new address.
+	if (!res) device->next_address = i2c_address;
+	return res;
+}
+
+// Address and serial number of a discovered device.
+typedef struct {
+	uint64_t serial;
+	uint8_t  address;
+} nt3h2111_found_t;
+
+// Scan the bus for devices and initialise a handle for each, ordered by serial number.
+esp_err_t nt3h2111_discover(int i2c_bus, int first, int last, NT3H2111 devices[], size_t cap, size_t *found) {
+	if (first < 0x08 || last > 0x77 || first > last) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	nt3h2111_found_t *list = malloc((last - first + 1) * sizeof(nt3h2111_found_t));
+	if (!list) {
+		return ESP_ERR_NO_MEM;
+	}
+	
+	// Look for the manufacturer ID at every address.
+	size_t count = 0;
+	for (int address = first; address <= last; address++) {
+		NT3H2111 probe = {
+			.i2c_bus     = i2c_bus,
+			.i2c_address = address,
+		};
+		
+		// A read does not disturb other devices; only read block 0 if something acknowledges.
+		uint8_t tmp[16];
+		if (i2c_read_bytes(i2c_bus, address, tmp, 1)) continue;
+		if (nt3h2111_bus_read(&probe, 0, tmp) || tmp[0] != NT3H2111_MANUFACTURER_ID) continue;
+		
+		// Insert sorted by serial number.
+		uint64_t serial = read_uint48(tmp + 1);
+		size_t   i      = count++;
+		while (i && list[i-1].serial > serial) {
+			list[i] = list[i-1];
+			i--;
+		}
+		list[i].serial  = serial;
+		list[i].address = address;
+	}
+	
+	// Initialise the handles.
+	esp_err_t res = ESP_OK;
+	for (size_t i = 0; i < count && i < cap && !res; i++) {
+		res = nt3h2111_init(&devices[i], i2c_bus, list[i].address);
+	}
+	free(list);
+	*found = count;
+	return res;
+}
+
+
 // Get device serial number.
 esp_err_t nt3h2111_get_serial(NT3H2111 *device, uint64_t *serial) {
 	uint8_t tmp[6];
@@ -103,13 +599,10 @@ esp_err_t nt3h2111_set_cc(NT3H2111 *device, uint32_t cc) {
 	return nt3h2111_write_raw(device, 12, 4, tmp);
 }
 
-// Get NDEF encoded NDEF data.
-esp_err_t nt3h2111_get_ndef(NT3H2111 *device, size_t *len, uint8_t **data) {
-	// Read the header.
-	size_t  ndef_len;
-	uint8_t offset;
-	uint8_t tmp[16];
-	nt3h2111_read_page(device, 1, tmp);
+// Read and parse the NDEF TLV header from page 1.
+static esp_err_t nt3h2111_ndef_header(NT3H2111 *device, uint8_t tmp[16], size_t *ndef_len, size_t *offset) {
+	esp_err_t res = nt3h2111_read_page(device, 1, tmp);
+	if (res) return res;
 	
 	// Check magic value.
 	if (tmp[0] != 0x03) {
@@ -117,21 +610,46 @@ esp_err_t nt3h2111_get_ndef(NT3H2111 *device, size_t *len, uint8_t **data) {
 	}
 	// Determine length.
 	if (tmp[1] == 0xff) {
-		ndef_len = (tmp[2] << 8) | tmp[3];
-		offset   = 4;
+		*ndef_len = (tmp[2] << 8) | tmp[3];
+		*offset   = 4;
 	} else {
-		ndef_len = tmp[1];
-		offset   = 2;
+		*ndef_len = tmp[1];
+		*offset   = 2;
+	}
+	// Bounds check.
+	if (*offset + *ndef_len > NT3H2111_USERDATA_LEN) {
+		return ESP_ERR_INVALID_SIZE;
 	}
+	return ESP_OK;
+}
+
+// Read the NDEF TLV value following a header read by nt3h2111_ndef_header.
+static esp_err_t nt3h2111_ndef_body(NT3H2111 *device, const uint8_t tmp[16], size_t offset, size_t ndef_len, uint8_t data[]) {
+	// Take what is left in the header page.
+	size_t head = 16 - offset < ndef_len ? 16 - offset : ndef_len;
+	memcpy(data, tmp + offset, head);
+	
+	// Read the rest from userdata.
+	return nt3h2111_read_user(device, 16, ndef_len - head, data + head);
+}
+
+// Get NDEF encoded NDEF data into a newly allocated buffer.
+static esp_err_t nt3h2111_get_ndef_alloc(NT3H2111 *device, size_t *len, uint8_t **data) {
+	// Read the header.
+	size_t  ndef_len;
+	size_t  offset;
+	uint8_t tmp[16];
+	esp_err_t res = nt3h2111_ndef_header(device, tmp, &ndef_len, &offset);
+	if (res) return res;
 	
 	// Allocate memory.
-	uint8_t *buf = malloc(ndef_len);
+	uint8_t *buf = malloc(ndef_len ? ndef_len : 1);
 	if (!buf) {
 		return ESP_ERR_NO_MEM;
 	}
 	
-	// Read the rest from userdata.
-	esp_err_t res = nt3h2111_read_user(device, offset, ndef_len, buf);
+	// Read the rest.
+	res = nt3h2111_ndef_body(device, tmp, offset, ndef_len, buf);
 	if (res) {
 		free(buf);
 		return res;
@@ -143,42 +661,110 @@ esp_err_t nt3h2111_get_ndef(NT3H2111 *device, size_t *len, uint8_t **data) {
 	return ESP_OK;
 }
 
-// Set NDEF encoded NDEF data.
-esp_err_t nt3h2111_set_ndef(NT3H2111 *device, size_t len, const uint8_t data[]) {
+// Get NDEF encoded NDEF data into a caller-provided buffer.
+static esp_err_t nt3h2111_read_ndef_into(NT3H2111 *device, size_t cap, uint8_t data[], size_t *len) {
+	// Read the header.
+	size_t  ndef_len;
+	size_t  offset;
+	uint8_t tmp[16];
+	esp_err_t res = nt3h2111_ndef_header(device, tmp, &ndef_len, &offset);
+	if (res) return res;
+	
+	// Report the required size.
+	*len = ndef_len;
+	if (ndef_len > cap) {
+		return ESP_ERR_NO_MEM;
+	}
+	
+	// Read the rest.
+	return nt3h2111_ndef_body(device, tmp, offset, ndef_len, data);
+}
+
+// Set NDEF encoded NDEF data, optionally skipping pages that would not change.
+// The TLV is assembled page by page so that every page is programmed at most once.
+static esp_err_t nt3h2111_set_ndef_pages(NT3H2111 *device, size_t len, const uint8_t data[], bool diff, size_t *written) {
 	// Format header.
-	uint8_t tmp[4] = { 0x03, 0x00, 0x00, 0x00 };
-	size_t offset;
-	esp_err_t res;
+	uint8_t hdr[4] = { 0x03, 0x00, 0x00, 0x00 };
+	size_t  hdr_len;
 	if (len >= NT3H2111_USERDATA_LEN - 4) {
 		return ESP_ERR_NO_MEM;
 	} else if (len >= 0xff) {
-		tmp[1] = 0xff;
-		tmp[2] = len >> 8;
-		tmp[3] = len;
-		res    = nt3h2111_write_user(device, 0, 4, tmp);
-		if (res) return res;
-		offset = 4;
+		hdr[1]  = 0xff;
+		hdr[2]  = len >> 8;
+		hdr[3]  = len;
+		hdr_len = 4;
 	} else {
-		tmp[1] = len;
-		res    = nt3h2111_write_user(device, 0, 2, tmp);
-		if (res) return res;
-		offset = 2;
+		hdr[1]  = len;
+		hdr_len = 2;
 	}
+	esp_err_t res = nt3h2111_arbitrate(device);
+	if (res) return res;
 	
-	// Write the datas.
-	res = nt3h2111_write_user(device, offset, len, data);
-	
-	// Write the terminating verse.
-	tmp[0] = 0xfe;
-	nt3h2111_write_user(device, offset + len, 1, tmp);
+	// Header, datas and terminating verse, starting at page 1.
+	size_t  total = hdr_len + len + 1;
+	uint8_t tmp[16];
+	for (size_t pos = 0; pos < total; pos += 16) {
+		size_t plen = total - pos < 16 ? total - pos : 16;
+		
+		// Assemble the page image.
+		for (size_t i = 0; i < plen; i++) {
+			size_t idx = pos + i;
+			if (idx < hdr_len) {
+				tmp[i] = hdr[idx];
+			} else if (idx < hdr_len + len) {
+				tmp[i] = data[idx - hdr_len];
+			} else {
+				tmp[i] = 0xfe;
+			}
+		}
+		
+		// Write page.
+		res = nt3h2111_write_part(device, 1 + pos / 16, 0, plen, tmp, diff, written);
+		if (res) return res;
+	}
 	
 	return ESP_OK;
 }
 
+// Get NDEF encoded NDEF data.
+esp_err_t nt3h2111_get_ndef(NT3H2111 *device, size_t *len, uint8_t **data) {
+	int64_t   start = esp_timer_get_time();
+	esp_err_t res   = nt3h2111_get_ndef_alloc(device, len, data);
+	nt3h2111_hist_add(device, NT3H2111_OP_GET_NDEF, start);
+	return res;
+}
+
+// Get NDEF encoded NDEF data into a caller-provided buffer.
+esp_err_t nt3h2111_read_ndef(NT3H2111 *device, size_t cap, uint8_t data[], size_t *len) {
+	int64_t   start = esp_timer_get_time();
+	esp_err_t res   = nt3h2111_read_ndef_into(device, cap, data, len);
+	nt3h2111_hist_add(device, NT3H2111_OP_GET_NDEF, start);
+	return res;
+}
+
+// Set NDEF encoded NDEF data, optionally skipping pages that would not change.
+static esp_err_t nt3h2111_set_ndef_ex(NT3H2111 *device, size_t len, const uint8_t data[], bool diff, size_t *written) {
+	int64_t   start = esp_timer_get_time();
+	esp_err_t res   = nt3h2111_set_ndef_pages(device, len, data, diff, written);
+	nt3h2111_hist_add(device, NT3H2111_OP_SET_NDEF, start);
+	return res;
+}
+
+// Set NDEF encoded NDEF data.
+esp_err_t nt3h2111_set_ndef(NT3H2111 *device, size_t len, const uint8_t data[]) {
+	return nt3h2111_set_ndef_ex(device, len, data, false, NULL);
+}
+
+// Set NDEF encoded NDEF data, only programming pages whose contents differ.
+esp_err_t nt3h2111_set_ndef_diff(NT3H2111 *device, size_t len, const uint8_t data[], size_t *written) {
+	if (written) *written = 0;
+	return nt3h2111_set_ndef_ex(device, len, data, true, written);
+}
+
 
 
 // Read user data EEPROM.
-esp_err_t nt3h2111_read_user(NT3H2111 *device, uint16_t offset, uint8_t len, uint8_t data[]) {
+esp_err_t nt3h2111_read_user(NT3H2111 *device, uint16_t offset, uint16_t len, uint8_t data[]) {
 	if (!len) return ESP_OK;
 	
 	// Bounds check.
@@ -191,7 +777,7 @@ esp_err_t nt3h2111_read_user(NT3H2111 *device, uint16_t offset, uint8_t len, uin
 }
 
 // Write user data EEPROM.
-esp_err_t nt3h2111_write_user(NT3H2111 *device, uint16_t offset, uint8_t len, const uint8_t data[]) {
+esp_err_t nt3h2111_write_user(NT3H2111 *device, uint16_t offset, uint16_t len, const uint8_t data[]) {
 	if (!len) return ESP_OK;
 	
 	// Bounds check.
@@ -213,7 +799,7 @@ esp_err_t nt3h2111_read_sram(NT3H2111 *device, uint8_t offset, uint8_t len, uint
 	}
 	
 	// Forward the read.
-	return nt3h2111_read_raw(device, 248*16+offset, len, data);
+	return nt3h2111_read_raw(device, NT3H2111_SRAM_PAGE*16+offset, len, data);
 }
 
 // Write SRAM.
@@ -226,22 +812,29 @@ esp_err_t nt3h2111_write_sram(NT3H2111 *device, uint8_t offset, uint8_t len, con
 	}
 	
 	// Forward the write.
-	return nt3h2111_write_raw(device, 248*16+offset, len, data);
+	return nt3h2111_write_raw(device, NT3H2111_SRAM_PAGE*16+offset, len, data);
 }
 
 
 // Unaligned raw read.
-esp_err_t nt3h2111_read_raw(NT3H2111 *device, uint8_t offset, uint8_t len, uint8_t data[]) {
+esp_err_t nt3h2111_read_raw(NT3H2111 *device, uint16_t offset, uint16_t len, uint8_t data[]) {
 	esp_err_t res = 0;
 	uint8_t tmp[16];
 	
+	// Bounds check.
+	if (offset + len > NT3H2111_RAW_LEN) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	res = nt3h2111_arbitrate(device);
+	if (res) return res;
+	
 	// First page misaligned read.
 	size_t misalign = offset & 15;
 	if (misalign) {
 		size_t rlen = 16-misalign < len ? 16-misalign : len;
 		
 		// Read page.
-		res = nt3h2111_read_page(device, offset / 16, tmp);
+		res = nt3h2111_page_read(device, offset / 16, tmp);
 		if (res) return res;
 		memcpy(data, tmp + misalign, rlen);
 		
@@ -254,7 +847,7 @@ esp_err_t nt3h2111_read_raw(NT3H2111 *device, uint8_t offset, uint8_t len, uint8
 	// Intermediary pages aligned read.
 	while (len >= 16) {
 		// Read page.
-		res = nt3h2111_read_page(device, offset / 16, data);
+		res = nt3h2111_page_read(device, offset / 16, data);
 		if (res) return res;
 		
 		// Increment some pointers.
@@ -266,7 +859,7 @@ esp_err_t nt3h2111_read_raw(NT3H2111 *device, uint8_t offset, uint8_t len, uint8
 	// Last page misaligned read.
 	if (len) {
 		// Read page.
-		res = nt3h2111_read_page(device, offset / 16, tmp);
+		res = nt3h2111_page_read(device, offset / 16, tmp);
 		if (res) return res;
 		memcpy(data, tmp, len);
 	}
@@ -274,76 +867,1140 @@ esp_err_t nt3h2111_read_raw(NT3H2111 *device, uint8_t offset, uint8_t len, uint8
 	return ESP_OK;
 }
 
-// Unaligned raw write.
-esp_err_t nt3h2111_write_raw(NT3H2111 *device, uint8_t offset, uint8_t len, const uint8_t data[]) {
-	esp_err_t res = 0;
-	uint8_t tmp[16];
+// Write part of a page, optionally skipping the write if it would not change.
+// Adds 1 to `written` if not NULL and the page was programmed.
+static esp_err_t nt3h2111_write_part(NT3H2111 *device, uint8_t page, size_t misalign, size_t wlen, const uint8_t data[], bool diff, size_t *written) {
+	esp_err_t res;
+	uint8_t   tmp[16];
 	
-	// First page misaligned read.
-	size_t misalign = offset & 15;
-	if (misalign) {
-		size_t rlen = 16-misalign < len ? 16-misalign : len;
-		
+	// Partial pages need a read-modify-write; compared pages need a read.
+	const uint8_t *page_data = data;
+	bool           changed   = true;
+	if (wlen < 16 || diff) {
+		if (wlen < 16) device->stats.rmw_cycles++;
 		// Read page.
-		res = nt3h2111_read_page(device, offset / 16, tmp);
-		if (res) return res;
-		memcpy(tmp + misalign, data, rlen);
-		
-		// Re-write page.
-		res = nt3h2111_write_page(device, offset / 16, tmp);
+		res = nt3h2111_page_read(device, page, tmp);
 		if (res) return res;
-		
-		// Increment some pointers.
-		data   += rlen;
-		len    -= rlen;
-		offset += rlen;
+		changed = memcmp(tmp + misalign, data, wlen) != 0;
+		memcpy(tmp + misalign, data, wlen);
+		page_data = tmp;
+		// Byte 0 of page 0 reads as the manufacturer ID but sets the I2C address when written.
+		if (page == 0 && misalign) tmp[0] = device->next_address << 1;
 	}
 	
-	// Intermediary pages aligned read.
-	while (len >= 16) {
-		// Read page.
-		res = nt3h2111_write_page(device, offset / 16, data);
+	// Re-write page.
+	if (changed || !diff) {
+		res = nt3h2111_page_write(device, page, page_data);
 		if (res) return res;
-		
-		// Increment some pointers.
-		data   += 16;
-		len    -= 16;
-		offset += 16;
+		if (written) (*written)++;
 	}
 	
-	// Last page misaligned read.
-	if (len) {
-		// Read page.
-		res = nt3h2111_read_page(device, offset / 16, tmp);
-		if (res) return res;
-		memcpy(tmp, data, len);
+	return ESP_OK;
+}
+
+// Unaligned raw write, optionally skipping pages that would not change.
+// Adds the number of pages programmed to `written` if not NULL.
+static esp_err_t nt3h2111_write_raw_ex(NT3H2111 *device, uint16_t offset, uint16_t len, const uint8_t data[], bool diff, size_t *written) {
+	esp_err_t res = 0;
+	
+	// Bounds check.
+	if (offset + len > NT3H2111_RAW_LEN) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	res = nt3h2111_arbitrate(device);
+	if (res) return res;
+	
+	while (len) {
+		size_t misalign = offset & 15;
+		size_t wlen     = 16-misalign < len ? 16-misalign : len;
 		
-		// Re-write page.
-		res = nt3h2111_write_page(device, offset / 16, tmp);
+		// Write page.
+		res = nt3h2111_write_part(device, offset / 16, misalign, wlen, data, diff, written);
 		if (res) return res;
+		
+		// Increment some pointers.
+		data   += wlen;
+		len    -= wlen;
+		offset += wlen;
 	}
 	
 	return ESP_OK;
 }
 
-// Used to keep delays between writes and subsequent accesses.
-static int64_t last_write_time = 0;
+// Unaligned raw write.
+esp_err_t nt3h2111_write_raw(NT3H2111 *device, uint16_t offset, uint16_t len, const uint8_t data[]) {
+	return nt3h2111_write_raw_ex(device, offset, len, data, false, NULL);
+}
 
-// Page-aligned raw read.
-esp_err_t nt3h2111_read_page(NT3H2111 *device, uint8_t page, uint8_t data[16]) {
-	// Wait for EEPROM write if required.
-	while (last_write_time + 5000 > esp_timer_get_time()) sched_yield();
-	// Send read command.
-	return i2c_read_reg(device->i2c_bus, device->i2c_address, page, data, 16);
+// Unaligned raw write that only programs pages whose contents differ.
+esp_err_t nt3h2111_write_raw_diff(NT3H2111 *device, uint16_t offset, uint16_t len, const uint8_t data[], size_t *written) {
+	if (written) *written = 0;
+	return nt3h2111_write_raw_ex(device, offset, len, data, true, written);
 }
 
-// Page-aligned raw write.
-esp_err_t nt3h2111_write_page(NT3H2111 *device, uint8_t page, const uint8_t data[16]) {
-	// Wair for EEPROM write if required.
-	while (last_write_time + 5000 > esp_timer_get_time()) sched_yield();
-	// Set EEPROM write timer if applicable.
-	/*if (page < 284 || page >= 248+64/16) */last_write_time = esp_timer_get_time();
-	// Send write command.
-	return i2c_write_reg_n(device->i2c_bus, device->i2c_address, page, data, 16);
+// Determine whether the last EEPROM write may still be in progress.
+static bool nt3h2111_eeprom_busy(NT3H2111 *device) {
+	nt3h2111_writeback_t *wb   = nt3h2111_lock(device);
+	bool                  busy = device->last_write_time != 0;
+	
+	// The worst-case programming time has passed.
+	if (busy && esp_timer_get_time() >= device->last_write_time + NT3H2111_EEPROM_WRITE_US) {
+		device->last_write_time = 0;
+		busy = false;
+	}
+	
+	// Ask the device; a NACK also means it is still busy.
+	if (busy && device->wait_mode == NT3H2111_WAIT_POLL) {
+		uint8_t ns;
+		if (!nt3h2111_poll_session(device, NT3H2111_REG_NS, &ns) && !(ns & NT3H2111_NS_EEPROM_WR_BUSY)) {
+			device->last_write_time = 0;
+			busy = false;
+		}
+	}
+	
+	nt3h2111_unlock(wb);
+	return busy;
+}
+
+#if CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+// Wakes a task blocked in nt3h2111_sleep_until; runs from the timer ISR.
+static void IRAM_ATTR nt3h2111_sleep_timer_cb(void *arg) {
+	NT3H2111  *device = arg;
+	BaseType_t woken  = pdFALSE;
+	xSemaphoreGiveFromISR(device->sleep_sem, &woken);
+	if (woken) esp_timer_isr_dispatch_need_yield();
 }
+#endif
 
+// Wait until the given time, blocking if enabled so the CPU can sleep.
+static void nt3h2111_sleep_until(NT3H2111 *device, int64_t until) {
+	int64_t now = esp_timer_get_time();
+	if (until <= now) return;
+	
+	if (device->sleep_wait) {
+		// Do not keep the flush task or other callers waiting while blocked.
+		nt3h2111_writeback_t *wb    = device->writeback;
+		UBaseType_t           depth = wb && wb->holder == xTaskGetCurrentTaskHandle() ? wb->depth : 0;
+		for (UBaseType_t i = 0; i < depth; i++) nt3h2111_unlock(wb);
+		
+#if CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+		// Another task of this device may be using the timer; spin in that case.
+		bool slept = !esp_timer_start_once(device->sleep_timer, until - now);
+		if (slept) xSemaphoreTake(device->sleep_sem, portMAX_DELAY);
+#else
+		// Block for whole ticks and spin the rest.
+		TickType_t ticks = (until - now) / (portTICK_PERIOD_MS * 1000);
+		bool       slept = ticks > 0;
+		if (slept) vTaskDelay(ticks);
+#endif
+		
+		for (UBaseType_t i = 0; i < depth; i++) nt3h2111_lock(device);
+		if (slept) device->stats.sleep_time += esp_timer_get_time() - now;
+	}
+	
+	while (until > esp_timer_get_time()) sched_yield();
+}
+
+// Time at which to check again for a busy EEPROM.
+static int64_t nt3h2111_next_check(NT3H2111 *device) {
+	// Wait until the deadline or the next poll, whichever is first.
+	int64_t until = device->last_write_time + NT3H2111_EEPROM_WRITE_US;
+	if (device->wait_mode == NT3H2111_WAIT_POLL) {
+		int64_t next = esp_timer_get_time() + device->poll_backoff;
+		if (next < until) until = next;
+	}
+	return until;
+}
+
+// Wait for EEPROM write if required.
+static void nt3h2111_wait_eeprom(NT3H2111 *device) {
+	nt3h2111_writeback_t *wb = nt3h2111_lock(device);
+	if (device->last_write_time) {
+		int64_t start = esp_timer_get_time();
+		while (nt3h2111_eeprom_busy(device)) {
+			int64_t until = nt3h2111_next_check(device);
+			nt3h2111_sleep_until(device, until);
+		}
+		device->stats.wait_time += esp_timer_get_time() - start;
+	}
+	nt3h2111_unlock(wb);
+}
+
+// Completes a pending asynchronous write once the worst-case programming time has passed.
+// Only the timestamp is used: the bus and device state belong to the calling task.
+static void nt3h2111_write_timer_cb(void *arg) {
+	NT3H2111 *device = arg;
+	
+	// Notify the caller.
+	nt3h2111_write_cb_t cb  = device->write_cb;
+	void               *ctx = device->write_cb_ctx;
+	device->write_cb = NULL;
+	if (cb) cb(device, ctx);
+}
+
+// Whether an EEPROM write is still in progress.
+bool nt3h2111_is_busy(NT3H2111 *device) {
+	return device->write_cb || nt3h2111_eeprom_busy(device);
+}
+
+// Check for RF activity before an access: drop the cache if the phone may
+// have changed the EEPROM, and apply the lock policy.
+static esp_err_t nt3h2111_arbitrate_rf(NT3H2111 *device) {
+	nt3h2111_lock_policy_t policy = device->lock_policy;
+	nt3h2111_cache_t      *cache  = device->cache;
+	
+	// The field detect pin tracks the field without bus traffic.
+	bool fd_field = device->fd_pin != GPIO_NUM_NC && !(device->fd_config & NT3H2111_NC_FD_ON);
+	if (cache && fd_field) {
+		if (device->fd_field_seen || !gpio_get_level(device->fd_pin)) {
+			device->fd_field_seen = false;
+			cache->valid          = 0;
+		}
+	}
+	if (policy == NT3H2111_LOCK_IGNORE && (!cache || fd_field)) {
+		return ESP_OK;
+	}
+	
+	// NS_REG is readable while the EEPROM is busy, so do not wait for it here.
+	int64_t deadline = esp_timer_get_time() + device->lock_timeout;
+	while (1) {
+		// The cache may have changed while asleep.
+		cache = device->cache;
+		uint8_t   ns;
+		esp_err_t res = nt3h2111_poll_session(device, NT3H2111_REG_NS, &ns);
+		if (res) {
+			// The device NACKs while the phone holds it, so treat it as locked; the access itself may still work.
+			if (cache) cache->valid = 0;
+			if (policy == NT3H2111_LOCK_IGNORE) return ESP_OK;
+			ns = NT3H2111_NS_RF_FIELD_PRESENT | NT3H2111_NS_RF_LOCKED;
+		} else if (cache && !fd_field && (ns & NT3H2111_NS_RF_FIELD_PRESENT)) {
+			cache->valid = 0;
+		}
+		
+		// Determine whether the phone is in the way.
+		bool blocked;
+		if (policy == NT3H2111_LOCK_WAIT_FIELD_OFF) {
+			blocked = ns & NT3H2111_NS_RF_FIELD_PRESENT;
+		} else {
+			blocked = policy != NT3H2111_LOCK_IGNORE && (ns & NT3H2111_NS_RF_LOCKED);
+		}
+		if (!blocked) return ESP_OK;
+		if (policy == NT3H2111_LOCK_FAIL) return ESP_ERR_INVALID_STATE;
+		
+		// Poll again after the backoff; a timeout of 0 waits forever.
+		int64_t now = esp_timer_get_time();
+		if (device->lock_timeout && now >= deadline) return ESP_ERR_TIMEOUT;
+		int64_t until = now + device->poll_backoff;
+		nt3h2111_sleep_until(device, device->lock_timeout && until > deadline ? deadline : until);
+	}
+}
+
+// Check for RF activity before an access, serialised against the flush task.
+static esp_err_t nt3h2111_arbitrate(NT3H2111 *device) {
+	nt3h2111_writeback_t *wb  = nt3h2111_lock(device);
+	esp_err_t             res = nt3h2111_arbitrate_rf(device);
+	nt3h2111_unlock(wb);
+	return res;
+}
+
+// Page-aligned read through the cache, bypassing the write-back buffer.
+static esp_err_t nt3h2111_page_fetch(NT3H2111 *device, uint8_t page, uint8_t data[16]) {
+	int64_t           start  = esp_timer_get_time();
+	nt3h2111_cache_t *cache  = device->cache;
+	bool              cached = cache && page < NT3H2111_CACHE_PAGES;
+	
+	// Try the cache first.
+	if (cached && (cache->valid >> page) & 1) {
+		cache->hits++;
+		memcpy(data, cache->pages[page], 16);
+		nt3h2111_hist_add(device, NT3H2111_OP_READ_PAGE, start);
+		return ESP_OK;
+	}
+	
+	// Wait for EEPROM write if required; the cache may change meanwhile.
+	nt3h2111_wait_eeprom(device);
+	cache  = device->cache;
+	cached = cache && page < NT3H2111_CACHE_PAGES;
+	// Send read command.
+	esp_err_t res = nt3h2111_bus_read(device, page, data);
+	
+	// Update the cache.
+	if (cached) {
+		cache->misses++;
+		if (!res) {
+			memcpy(cache->pages[page], data, 16);
+			cache->valid |= 1llu << page;
+		}
+	}
+	nt3h2111_hist_add(device, NT3H2111_OP_READ_PAGE, start);
+	return res;
+}
+
+// Page-aligned write through the cache, bypassing the write-back buffer.
+static esp_err_t nt3h2111_page_program(NT3H2111 *device, uint8_t page, const uint8_t data[16]) {
+	int64_t start = esp_timer_get_time();
+	// Wait for EEPROM write if required.
+	nt3h2111_wait_eeprom(device);
+	// Send write command.
+	esp_err_t res = nt3h2111_bus_write(device, page, data);
+	// Set EEPROM write timer if applicable; SRAM and registers need no delay.
+	if (!res && page < NT3H2111_SRAM_PAGE) {
+		device->last_write_time = esp_timer_get_time();
+		device->stats.eeprom_writes++;
+	}
+	
+	// Update the cache; page 0 does not read back as written.
+	nt3h2111_cache_t *cache = device->cache;
+	if (cache && page < NT3H2111_CACHE_PAGES) {
+		if (!res && page != 0) {
+			memcpy(cache->pages[page], data, 16);
+			cache->valid |= 1llu << page;
+		} else {
+			cache->valid &= ~(1llu << page);
+		}
+	}
+	nt3h2111_hist_add(device, NT3H2111_OP_WRITE_PAGE, start);
+	return res;
+}
+
+// Whether a page is held by the write-back buffer.
+static inline bool nt3h2111_writeback_page(uint8_t page) {
+	return page >= 1 && page < NT3H2111_CACHE_PAGES;
+}
+
+// Page-aligned read through the write-back buffer and the cache.
+static esp_err_t nt3h2111_page_read(NT3H2111 *device, uint8_t page, uint8_t data[16]) {
+	nt3h2111_writeback_t *wb = device->writeback;
+	if (!wb) return nt3h2111_page_fetch(device, page, data);
+	
+	// Dirty pages are newer than the device.
+	esp_err_t res = ESP_OK;
+	nt3h2111_lock(device);
+	if (nt3h2111_writeback_page(page) && (wb->dirty >> page) & 1) {
+		memcpy(data, wb->pages[page], 16);
+	} else {
+		res = nt3h2111_page_fetch(device, page, data);
+	}
+	nt3h2111_unlock(wb);
+	return res;
+}
+
+// Page-aligned write through the write-back buffer and the cache.
+static esp_err_t nt3h2111_page_write(NT3H2111 *device, uint8_t page, const uint8_t data[16]) {
+	nt3h2111_writeback_t *wb = device->writeback;
+	if (!wb) return nt3h2111_page_program(device, page, data);
+	
+	esp_err_t res = ESP_OK;
+	nt3h2111_lock(device);
+	if (nt3h2111_writeback_page(page)) {
+		// Hold the page until the device has been quiet for a while.
+		memcpy(wb->pages[page], data, 16);
+		wb->dirty |= 1llu << page;
+		if (wb->quiet) {
+			esp_timer_stop(wb->timer);
+			esp_timer_start_once(wb->timer, wb->quiet);
+		}
+	} else {
+		res = nt3h2111_page_program(device, page, data);
+	}
+	nt3h2111_unlock(wb);
+	return res;
+}
+
+// Program all dirty pages of the write-back buffer.
+esp_err_t nt3h2111_flush(NT3H2111 *device) {
+	nt3h2111_writeback_t *wb = device->writeback;
+	if (!wb) return ESP_OK;
+	
+	esp_err_t res = ESP_OK;
+	nt3h2111_lock(device);
+	if (wb->timer) esp_timer_stop(wb->timer);
+	for (uint8_t page = 1; page < NT3H2111_CACHE_PAGES && !res; page++) {
+		if (!((wb->dirty >> page) & 1)) continue;
+		res = nt3h2111_page_program(device, page, wb->pages[page]);
+		if (!res) wb->dirty &= ~(1llu << page);
+	}
+	nt3h2111_unlock(wb);
+	return res;
+}
+
+// Wakes the flush task after the quiet period; the esp_timer task does no bus traffic itself.
+static void nt3h2111_writeback_timer_cb(void *arg) {
+	nt3h2111_writeback_t *wb = arg;
+	if (!wb->stop) xTaskNotifyGive(wb->flush_task);
+}
+
+// Flushes the write-back buffer when woken by the quiet timer.
+static void nt3h2111_writeback_task(void *arg) {
+	nt3h2111_writeback_t *wb     = arg;
+	NT3H2111             *device = wb->device;
+	
+	while (1) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		if (wb->stop) break;
+		
+		// Wait for the phone to leave if the field detect pin says it is there.
+		if (device->fd_pin != GPIO_NUM_NC && !(device->fd_config & NT3H2111_NC_FD_ON) && !gpio_get_level(device->fd_pin)) {
+			esp_timer_start_once(wb->timer, wb->quiet);
+			continue;
+		}
+		
+		// Try again later if the flush failed.
+		if (nt3h2111_flush(device)) {
+			esp_timer_start_once(wb->timer, wb->quiet);
+		}
+	}
+	
+	// Nothing restarts the timer from here on.
+	if (wb->timer) esp_timer_stop(wb->timer);
+	xSemaphoreGive(wb->stopped);
+	vTaskDelete(NULL);
+}
+
+// Free the write-back buffer after stopping its task and then its timer.
+static void nt3h2111_writeback_free(nt3h2111_writeback_t *wb) {
+	// The task uses the timer, so it goes first.
+	if (wb->flush_task) {
+		wb->stop = true;
+		xTaskNotifyGive(wb->flush_task);
+		xSemaphoreTake(wb->stopped, portMAX_DELAY);
+	}
+	if (wb->timer) {
+		esp_timer_stop(wb->timer);
+		esp_timer_delete(wb->timer);
+	}
+	if (wb->stopped) vSemaphoreDelete(wb->stopped);
+	if (wb->lock)    vSemaphoreDelete(wb->lock);
+	free(wb);
+}
+
+// Enable write-back buffering of the user data pages.
+esp_err_t nt3h2111_writeback_enable(NT3H2111 *device, int64_t quiet_us, UBaseType_t priority) {
+	if (device->writeback) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	
+	// Allocate the buffer.
+	nt3h2111_writeback_t *wb = calloc(1, sizeof(nt3h2111_writeback_t));
+	if (!wb) {
+		return ESP_ERR_NO_MEM;
+	}
+	wb->device  = device;
+	wb->quiet   = quiet_us;
+	wb->lock    = xSemaphoreCreateRecursiveMutex();
+	wb->stopped = xSemaphoreCreateBinary();
+	if (!wb->lock || !wb->stopped) {
+		nt3h2111_writeback_free(wb);
+		return ESP_ERR_NO_MEM;
+	}
+	device->writeback = wb;
+	if (!quiet_us) return ESP_OK;
+	
+	// Start the flush task.
+	if (xTaskCreate(nt3h2111_writeback_task, "nt3h2111_wb", 3072, wb, priority, &wb->flush_task) != pdPASS) {
+		wb->flush_task    = NULL;
+		device->writeback = NULL;
+		nt3h2111_writeback_free(wb);
+		return ESP_ERR_NO_MEM;
+	}
+	
+	// Create the quiet timer.
+	esp_timer_create_args_t timer_args = {
+		.callback = nt3h2111_writeback_timer_cb,
+		.arg      = wb,
+		.name     = "nt3h2111_wb",
+	};
+	esp_err_t res = esp_timer_create(&timer_args, &wb->timer);
+	if (res) {
+		wb->timer         = NULL;
+		device->writeback = NULL;
+		nt3h2111_writeback_free(wb);
+		return res;
+	}
+	return ESP_OK;
+}
+
+// Flush and disable write-back buffering; with `force`, dirty pages are dropped if the flush fails.
+static esp_err_t nt3h2111_writeback_disable_ex(NT3H2111 *device, bool force) {
+	nt3h2111_writeback_t *wb = device->writeback;
+	if (!wb) return ESP_OK;
+	
+	esp_err_t res = nt3h2111_flush(device);
+	if (res && !force) return res;
+	
+	device->writeback = NULL;
+	nt3h2111_writeback_free(wb);
+	return res;
+}
+
+// Flush and disable write-back buffering.
+esp_err_t nt3h2111_writeback_disable(NT3H2111 *device) {
+	return nt3h2111_writeback_disable_ex(device, false);
+}
+
+// Page-aligned raw read.
+esp_err_t nt3h2111_read_page(NT3H2111 *device, uint8_t page, uint8_t data[16]) {
+	esp_err_t res = nt3h2111_arbitrate(device);
+	if (res) return res;
+	return nt3h2111_page_read(device, page, data);
+}
+
+// Page-aligned raw write.
+esp_err_t nt3h2111_write_page(NT3H2111 *device, uint8_t page, const uint8_t data[16]) {
+	esp_err_t res = nt3h2111_arbitrate(device);
+	if (res) return res;
+	return nt3h2111_page_write(device, page, data);
+}
+
+// Read a session register.
+esp_err_t nt3h2111_read_reg(NT3H2111 *device, uint8_t reg, uint8_t *value) {
+	if (reg > NT3H2111_REG_NS) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	return nt3h2111_read_session(device, reg, value);
+}
+
+// Write the bits selected by `mask` of a session register in one transaction.
+esp_err_t nt3h2111_write_reg(NT3H2111 *device, uint8_t reg, uint8_t mask, uint8_t value) {
+	if (reg > NT3H2111_REG_NS) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	return nt3h2111_write_session(device, reg, mask, value);
+}
+
+// Set bits of a session register in one transaction.
+esp_err_t nt3h2111_set_reg_bits(NT3H2111 *device, uint8_t reg, uint8_t bits) {
+	return nt3h2111_write_reg(device, reg, bits, bits);
+}
+
+// Clear bits of a session register in one transaction.
+esp_err_t nt3h2111_clear_reg_bits(NT3H2111 *device, uint8_t reg, uint8_t bits) {
+	return nt3h2111_write_reg(device, reg, bits, 0);
+}
+
+// Unpack a register block into a register snapshot.
+static void nt3h2111_unpack_regs(const uint8_t raw[6], nt3h2111_regs_t *regs) {
+	regs->nc_reg            = raw[NT3H2111_REG_NC];
+	regs->last_ndef_block   = raw[NT3H2111_REG_LAST_NDEF_BLOCK];
+	regs->sram_mirror_block = raw[NT3H2111_REG_SRAM_MIRROR_BLOCK];
+	regs->wdt_ls            = raw[NT3H2111_REG_WDT_LS];
+	regs->wdt_ms            = raw[NT3H2111_REG_WDT_MS];
+	regs->i2c_clock_str     = raw[NT3H2111_REG_I2C_CLOCK_STR];
+	regs->ns_reg            = 0;
+	regs->reg_lock          = 0;
+}
+
+// Read all session registers.
+esp_err_t nt3h2111_get_session_regs(NT3H2111 *device, nt3h2111_regs_t *regs) {
+	// Session registers are only reachable one READ_REGISTER at a time.
+	uint8_t raw[7];
+	for (uint8_t reg = 0; reg < 7; reg++) {
+		esp_err_t res = nt3h2111_read_session(device, reg, &raw[reg]);
+		if (res) return res;
+	}
+	nt3h2111_unpack_regs(raw, regs);
+	regs->ns_reg = raw[NT3H2111_REG_NS];
+	return ESP_OK;
+}
+
+// Read all configuration registers in one block read.
+esp_err_t nt3h2111_get_config_regs(NT3H2111 *device, nt3h2111_regs_t *regs) {
+	uint8_t   raw[16];
+	esp_err_t res = nt3h2111_read_page(device, NT3H2111_CONFIG_PAGE, raw);
+	if (res) return res;
+	nt3h2111_unpack_regs(raw, regs);
+	regs->reg_lock = raw[NT3H2111_REG_LOCK];
+	return ESP_OK;
+}
+
+// Write all configuration registers to EEPROM; they are loaded into the session registers at power-on.
+esp_err_t nt3h2111_set_config_regs(NT3H2111 *device, const nt3h2111_regs_t *regs) {
+	// REG_LOCK is left alone; nt3h2111_lock_config sets it explicitly.
+	uint8_t raw[6] = {
+		[NT3H2111_REG_NC]                = regs->nc_reg,
+		[NT3H2111_REG_LAST_NDEF_BLOCK]   = regs->last_ndef_block,
+		[NT3H2111_REG_SRAM_MIRROR_BLOCK] = regs->sram_mirror_block,
+		[NT3H2111_REG_WDT_LS]            = regs->wdt_ls,
+		[NT3H2111_REG_WDT_MS]            = regs->wdt_ms,
+		[NT3H2111_REG_I2C_CLOCK_STR]     = regs->i2c_clock_str,
+	};
+	return nt3h2111_write_raw(device, NT3H2111_CONFIG_PAGE * 16, sizeof(raw), raw);
+}
+
+// Set bits in REG_LOCK, which permanently locks the configuration registers.
+esp_err_t nt3h2111_lock_config(NT3H2111 *device, uint8_t bits) {
+	if (bits & ~(NT3H2111_REG_LOCK_NFC | NT3H2111_REG_LOCK_I2C)) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	
+	// Lock bits can only be set, so keep the ones already there.
+	uint8_t   tmp[16];
+	esp_err_t res = nt3h2111_read_page(device, NT3H2111_CONFIG_PAGE, tmp);
+	if (res) return res;
+	tmp[NT3H2111_REG_LOCK] |= bits;
+	return nt3h2111_write_page(device, NT3H2111_CONFIG_PAGE, tmp);
+}
+
+// Turns field detect pin changes into events.
+static void IRAM_ATTR nt3h2111_fd_isr(void *arg) {
+	NT3H2111 *device = arg;
+	uint8_t   on     = (device->fd_config & NT3H2111_NC_FD_ON)  >> 2;
+	uint8_t   off    = (device->fd_config & NT3H2111_NC_FD_OFF) >> 4;
+	
+	// The pin is pulled low by the on-condition and released by the off-condition.
+	nt3h2111_event_t event = {
+		.device = device,
+		.time   = esp_timer_get_time(),
+	};
+	if (!gpio_get_level(device->fd_pin)) {
+		event.type = on == NT3H2111_FD_ON_DATA ? NT3H2111_EVT_SRAM_READY : NT3H2111_EVT_FIELD_ON;
+		device->fd_field_seen = true;
+	} else {
+		event.type = off == NT3H2111_FD_OFF_NDEF_READ ? NT3H2111_EVT_NDEF_READ : NT3H2111_EVT_FIELD_OFF;
+	}
+	
+	BaseType_t woken = pdFALSE;
+	xQueueSendFromISR(device->fd_queue, &event, &woken);
+	if (woken) portYIELD_FROM_ISR();
+}
+
+// Configure the field detect conditions and report pin changes as nt3h2111_event_t to `queue`.
+esp_err_t nt3h2111_fd_start(NT3H2111 *device, gpio_num_t pin, nt3h2111_fd_on_t on, nt3h2111_fd_off_t off, QueueHandle_t queue) {
+	if (device->fd_pin != GPIO_NUM_NC) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (!GPIO_IS_VALID_GPIO(pin) || !queue || (unsigned) on > NT3H2111_FD_ON_DATA || (unsigned) off > NT3H2111_FD_OFF_DATA) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	
+	// Set the field detect conditions.
+	uint8_t   config = (on << 2) | (off << 4);
+	esp_err_t res    = nt3h2111_write_session(device, NT3H2111_REG_NC, NT3H2111_NC_FD_ON | NT3H2111_NC_FD_OFF, config);
+	if (res) return res;
+	
+	// Configure the pin.
+	gpio_config_t pin_config = {
+		.pin_bit_mask = 1llu << pin,
+		.mode         = GPIO_MODE_INPUT,
+		.pull_up_en   = GPIO_PULLUP_ENABLE,
+		.pull_down_en = GPIO_PULLDOWN_DISABLE,
+		.intr_type    = GPIO_INTR_ANYEDGE,
+	};
+	res = gpio_config(&pin_config);
+	if (res) return res;
+	
+	// Install the interrupt handler.
+	res = gpio_install_isr_service(0);
+	if (res && res != ESP_ERR_INVALID_STATE) return res;
+	device->fd_config     = config;
+	device->fd_queue      = queue;
+	device->fd_field_seen = true;
+	device->fd_pin        = pin;
+	res = gpio_isr_handler_add(pin, nt3h2111_fd_isr, device);
+	if (res) device->fd_pin = GPIO_NUM_NC;
+	return res;
+}
+
+// Stop reporting field detect events.
+esp_err_t nt3h2111_fd_stop(NT3H2111 *device) {
+	if (device->fd_pin == GPIO_NUM_NC) return ESP_OK;
+	esp_err_t res = gpio_isr_handler_remove(device->fd_pin);
+	gpio_reset_pin(device->fd_pin);
+	device->fd_pin = GPIO_NUM_NC;
+	return res;
+}
+
+// Show the SRAM to the phone at the given user data offset instead of the EEPROM there.
+esp_err_t nt3h2111_sram_mirror_start(NT3H2111 *device, uint16_t offset) {
+	// Bounds check.
+	if ((offset & 15) || offset + NT3H2111_SRAM_LEN > NT3H2111_USERDATA_LEN) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	
+	// Select the block first so the phone never sees the SRAM elsewhere.
+	esp_err_t res = nt3h2111_write_session(device, NT3H2111_REG_SRAM_MIRROR_BLOCK, 0xff, 1 + offset / 16);
+	if (res) return res;
+	return nt3h2111_write_session(device, NT3H2111_REG_NC, NT3H2111_NC_SRAM_MIRROR_ON_OFF, NT3H2111_NC_SRAM_MIRROR_ON_OFF);
+}
+
+// Stop showing the SRAM to the phone.
+esp_err_t nt3h2111_sram_mirror_stop(NT3H2111 *device) {
+	return nt3h2111_write_session(device, NT3H2111_REG_NC, NT3H2111_NC_SRAM_MIRROR_ON_OFF, 0);
+}
+
+// Enable pass-through mode in the given direction; requires an RF field.
+esp_err_t nt3h2111_pthru_start(NT3H2111 *device, nt3h2111_pthru_dir_t dir) {
+	// The direction may only change while pass-through is off.
+	uint8_t   value = dir == NT3H2111_PTHRU_NFC_TO_I2C ? NT3H2111_NC_TRANSFER_DIR : 0;
+	esp_err_t res   = nt3h2111_write_session(device, NT3H2111_REG_NC, NT3H2111_NC_PTHRU_ON_OFF | NT3H2111_NC_TRANSFER_DIR, value);
+	if (res) return res;
+	return nt3h2111_write_session(device, NT3H2111_REG_NC, NT3H2111_NC_PTHRU_ON_OFF, NT3H2111_NC_PTHRU_ON_OFF);
+}
+
+// Disable pass-through mode.
+esp_err_t nt3h2111_pthru_stop(NT3H2111 *device) {
+	return nt3h2111_write_session(device, NT3H2111_REG_NC, NT3H2111_NC_PTHRU_ON_OFF, 0);
+}
+
+// Wait for an NS_REG bit to reach the given state while the RF field stays present.
+static esp_err_t nt3h2111_pthru_wait(NT3H2111 *device, uint8_t bit, bool state, int64_t timeout_us) {
+	int64_t deadline = esp_timer_get_time() + timeout_us;
+	while (1) {
+		uint8_t   ns;
+		esp_err_t res = nt3h2111_read_session(device, NT3H2111_REG_NS, &ns);
+		if (res) return res;
+		if (!(ns & NT3H2111_NS_RF_FIELD_PRESENT)) return ESP_ERR_INVALID_STATE;
+		if (!!(ns & bit) == state) return ESP_OK;
+		
+		// Poll again after the backoff.
+		int64_t now = esp_timer_get_time();
+		if (now >= deadline) return ESP_ERR_TIMEOUT;
+		int64_t until = now + device->poll_backoff;
+		nt3h2111_sleep_until(device, until < deadline ? until : deadline);
+	}
+}
+
+// Send data to the phone through the SRAM in 64-byte frames.
+esp_err_t nt3h2111_pthru_send(NT3H2111 *device, size_t len, const uint8_t data[], int64_t timeout_us) {
+	uint8_t frame[NT3H2111_SRAM_LEN];
+	while (len) {
+		size_t flen = len < NT3H2111_SRAM_LEN ? len : NT3H2111_SRAM_LEN;
+		memcpy(frame, data, flen);
+		memset(frame + flen, 0, NT3H2111_SRAM_LEN - flen);
+		
+		// Wait for the phone to take the previous frame.
+		esp_err_t res = nt3h2111_pthru_wait(device, NT3H2111_NS_SRAM_RF_READY, false, timeout_us);
+		if (res) return res;
+		
+		// Writing the last SRAM page hands the frame to the phone.
+		for (size_t i = 0; i < NT3H2111_SRAM_LEN / 16; i++) {
+			res = nt3h2111_page_write(device, NT3H2111_SRAM_PAGE + i, frame + i*16);
+			if (res) return res;
+		}
+		
+		// Increment some pointers.
+		data += flen;
+		len  -= flen;
+	}
+	return ESP_OK;
+}
+
+// Receive data from the phone through the SRAM in 64-byte frames.
+esp_err_t nt3h2111_pthru_recv(NT3H2111 *device, size_t len, uint8_t data[], int64_t timeout_us) {
+	uint8_t frame[NT3H2111_SRAM_LEN];
+	while (len) {
+		size_t flen = len < NT3H2111_SRAM_LEN ? len : NT3H2111_SRAM_LEN;
+		
+		// Wait for the phone to provide a frame.
+		esp_err_t res = nt3h2111_pthru_wait(device, NT3H2111_NS_SRAM_I2C_READY, true, timeout_us);
+		if (res) return res;
+		
+		// Reading the last SRAM page hands the SRAM back to the phone.
+		for (size_t i = 0; i < NT3H2111_SRAM_LEN / 16; i++) {
+			res = nt3h2111_page_read(device, NT3H2111_SRAM_PAGE + i, frame + i*16);
+			if (res) return res;
+		}
+		memcpy(data, frame, flen);
+		
+		// Increment some pointers.
+		data += flen;
+		len  -= flen;
+	}
+	return ESP_OK;
+}
+
+// Page-aligned raw write that returns without waiting for the EEPROM.
+esp_err_t nt3h2111_write_page_async(NT3H2111 *device, uint8_t page, const uint8_t data[16], nt3h2111_write_cb_t cb, void *ctx) {
+	if (nt3h2111_is_busy(device)) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	
+	// Create the completion timer on first use.
+	if (!device->write_timer) {
+		esp_timer_create_args_t timer_args = {
+			.callback = nt3h2111_write_timer_cb,
+			.arg      = device,
+			.name     = "nt3h2111",
+		};
+		esp_err_t res = esp_timer_create(&timer_args, &device->write_timer);
+		if (res) {
+			device->write_timer = NULL;
+			return res;
+		}
+	}
+	
+	// Send write command.
+	esp_err_t res = nt3h2111_write_page(device, page, data);
+	if (res) return res;
+	
+	// Arm the completion timer.
+	device->write_cb     = cb;
+	device->write_cb_ctx = ctx;
+	int64_t delay = device->last_write_time ? device->last_write_time + NT3H2111_EEPROM_WRITE_US - esp_timer_get_time() : 0;
+	res = esp_timer_start_once(device->write_timer, delay > 0 ? delay : 0);
+	if (res) device->write_cb = NULL;
+	return res;
+}
+
+
+
+// Initialise a bus scheduler using caller-provided queue storage.
+void nt3h2111_sched_init(nt3h2111_sched_t *sched, nt3h2111_sched_op_t *ops, size_t cap) {
+	sched->ops = ops;
+	sched->cap = cap;
+	sched->len = 0;
+}
+
+// Queue a page operation.
+static esp_err_t nt3h2111_sched_add(nt3h2111_sched_t *sched, nt3h2111_sched_op_t op) {
+	if (sched->len >= sched->cap) {
+		return ESP_ERR_NO_MEM;
+	}
+	sched->ops[sched->len++] = op;
+	return ESP_OK;
+}
+
+// Queue a page write; returns ESP_ERR_NO_MEM if the queue is full.
+esp_err_t nt3h2111_sched_write(nt3h2111_sched_t *sched, NT3H2111 *device, uint8_t page, const uint8_t data[16], esp_err_t *result) {
+	nt3h2111_sched_op_t op = {
+		.device = device,
+		.page   = page,
+		.write  = true,
+		.result = result,
+	};
+	memcpy(op.data, data, 16);
+	return nt3h2111_sched_add(sched, op);
+}
+
+// Queue a page read; returns ESP_ERR_NO_MEM if the queue is full.
+esp_err_t nt3h2111_sched_read(nt3h2111_sched_t *sched, NT3H2111 *device, uint8_t page, uint8_t data[16], esp_err_t *result) {
+	nt3h2111_sched_op_t op = {
+		.device = device,
+		.page   = page,
+		.write  = false,
+		.out    = data,
+		.result = result,
+	};
+	return nt3h2111_sched_add(sched, op);
+}
+
+// Run queued operations until the queue is empty.
+esp_err_t nt3h2111_sched_run(nt3h2111_sched_t *sched) {
+	esp_err_t first = ESP_OK;
+	while (sched->len) {
+		bool      issued = false;
+		int64_t   next   = INT64_MAX;
+		NT3H2111 *waitee = NULL;
+		
+		for (size_t i = 0; i < sched->len; i++) {
+			nt3h2111_sched_op_t *op = &sched->ops[i];
+			
+			// Only the oldest operation of each device may go.
+			bool earlier = false;
+			for (size_t j = 0; j < i && !earlier; j++) {
+				earlier = sched->ops[j].device == op->device;
+			}
+			if (earlier) continue;
+			
+			// Skip devices that are still programming.
+			if (nt3h2111_eeprom_busy(op->device)) {
+				int64_t check = nt3h2111_next_check(op->device);
+				if (check < next) {
+					next   = check;
+					waitee = op->device;
+				}
+				continue;
+			}
+			
+			// Issue the operation.
+			esp_err_t res = op->write
+				? nt3h2111_write_page(op->device, op->page, op->data)
+				: nt3h2111_read_page(op->device, op->page, op->out);
+			if (op->result) *op->result = res;
+			if (res && !first) first = res;
+			issued = true;
+			
+			// Remove it from the queue.
+			memmove(op, op + 1, (sched->len - i - 1) * sizeof(nt3h2111_sched_op_t));
+			sched->len--;
+			i--;
+		}
+		
+		// Wait for the first device to become available.
+		if (!issued) nt3h2111_sleep_until(waitee, next);
+	}
+	return first;
+}
+
+
+
+// Maximum number of requests the driver task handles at once.
+#define NT3H2111_TASK_BATCH 8
+
+// Request served by the driver task.
+typedef struct {
+	// Raw byte offset.
+	uint16_t          offset;
+	// Length in bytes; 0 with `data` NULL stops the task.
+	uint16_t          len;
+	// Whether this is a write.
+	bool              write;
+	// Data to read into or write from.
+	uint8_t          *data;
+	// Given on completion; private to the request, so nothing else can wake the caller early.
+	SemaphoreHandle_t done;
+	// Where to store the result.
+	esp_err_t        *result;
+} nt3h2111_request_t;
+
+// Driver task state.
+struct nt3h2111_task {
+	// Device served by the task.
+	NT3H2111          *device;
+	// Incoming requests.
+	QueueHandle_t      queue;
+	// Merged page images of queued writes.
+	uint8_t            pages[NT3H2111_RAW_LEN / 16][16];
+	// Bitmask of pages with a merged image.
+	uint32_t           dirty[NT3H2111_RAW_LEN / 16 / 32];
+	// Writes waiting for the merged pages to be programmed.
+	nt3h2111_request_t pending[NT3H2111_TASK_BATCH];
+	// Number of pending writes.
+	size_t             pending_len;
+	// Number of callers using the queue, guarded by nt3h2111_task_mux.
+	size_t             users;
+};
+
+// Guards the driver task pointers of all devices and the user counts of their tasks.
+static portMUX_TYPE nt3h2111_task_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Complete a request.
+static void nt3h2111_task_done(const nt3h2111_request_t *req, esp_err_t res) {
+	*req->result = res;
+	xSemaphoreGive(req->done);
+}
+
+// Merge a write into the page images.
+static esp_err_t nt3h2111_task_merge(NT3H2111 *device, struct nt3h2111_task *task, const nt3h2111_request_t *req) {
+	uint16_t       offset = req->offset;
+	uint16_t       len    = req->len;
+	const uint8_t *data   = req->data;
+	
+	// Read partially covered pages not yet merged first, so a failure leaves the images untouched.
+	uint8_t ends[2] = { offset / 16, (offset + len - 1) / 16 };
+	for (size_t i = 0; i < 2 && (i == 0 || ends[1] != ends[0]); i++) {
+		uint8_t page    = ends[i];
+		bool    partial = offset > page * 16 || offset + len < page * 16 + 16;
+		bool    dirty   = (task->dirty[page / 32] >> (page % 32)) & 1;
+		if (!partial || dirty) continue;
+		device->stats.rmw_cycles++;
+		esp_err_t res = nt3h2111_page_read(device, page, task->pages[page]);
+		if (res) return res;
+		if (page == 0) task->pages[0][0] = device->next_address << 1;
+	}
+	
+	while (len) {
+		uint8_t page     = offset / 16;
+		size_t  misalign = offset & 15;
+		size_t  wlen     = 16-misalign < len ? 16-misalign : len;
+		memcpy(task->pages[page] + misalign, data, wlen);
+		task->dirty[page / 32] |= 1lu << (page % 32);
+		
+		// Increment some pointers.
+		data   += wlen;
+		len    -= wlen;
+		offset += wlen;
+	}
+	return ESP_OK;
+}
+
+// Program the merged pages and complete the pending writes.
+static void nt3h2111_task_flush(NT3H2111 *device, struct nt3h2111_task *task, esp_err_t res) {
+	for (size_t page = 0; page < NT3H2111_RAW_LEN / 16; page++) {
+		if (!((task->dirty[page / 32] >> (page % 32)) & 1)) continue;
+		if (!res) res = nt3h2111_page_write(device, page, task->pages[page]);
+	}
+	memset(task->dirty, 0, sizeof(task->dirty));
+	
+	for (size_t i = 0; i < task->pending_len; i++) {
+		nt3h2111_task_done(&task->pending[i], res);
+	}
+	task->pending_len = 0;
+}
+
+// Serves requests for a device.
+static void nt3h2111_task_main(void *arg) {
+	struct nt3h2111_task *task   = arg;
+	NT3H2111             *device = task->device;
+	nt3h2111_request_t    batch[NT3H2111_TASK_BATCH];
+	
+	while (1) {
+		// Take whatever is queued, waiting for at least one request.
+		size_t count = 0;
+		xQueueReceive(task->queue, &batch[count++], portMAX_DELAY);
+		while (count < NT3H2111_TASK_BATCH && xQueueReceive(task->queue, &batch[count], 0)) count++;
+		
+		// Check for the phone once per batch.
+		esp_err_t res = nt3h2111_arbitrate(device);
+		
+		for (size_t i = 0; i < count; i++) {
+			nt3h2111_request_t *req = &batch[i];
+			if (!req->data) {
+				// Stop request; nothing after it in the batch is served.
+				nt3h2111_task_flush(device, task, res);
+				for (size_t j = i + 1; j < count; j++) {
+					nt3h2111_task_done(&batch[j], ESP_ERR_INVALID_STATE);
+				}
+				nt3h2111_task_done(req, ESP_OK);
+				vTaskDelete(NULL);
+				return;
+				
+			} else if (req->write) {
+				// Merge writes until something needs the merged contents.
+				esp_err_t merge_res = res ? res : nt3h2111_task_merge(device, task, req);
+				if (merge_res) {
+					nt3h2111_task_done(req, merge_res);
+				} else {
+					task->pending[task->pending_len++] = *req;
+				}
+				
+			} else {
+				// Reads see all earlier writes.
+				nt3h2111_task_flush(device, task, res);
+				esp_err_t read_res = res ? res : nt3h2111_read_raw(device, req->offset, req->len, req->data);
+				nt3h2111_task_done(req, read_res);
+			}
+		}
+		nt3h2111_task_flush(device, task, res);
+	}
+}
+
+// Start a driver task that owns the device.
+esp_err_t nt3h2111_task_start(NT3H2111 *device, UBaseType_t priority, size_t queue_len) {
+	if (device->task) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	
+	// Allocate the task state.
+	struct nt3h2111_task *task = calloc(1, sizeof(struct nt3h2111_task));
+	if (!task) {
+		return ESP_ERR_NO_MEM;
+	}
+	task->device = device;
+	task->queue  = xQueueCreate(queue_len, sizeof(nt3h2111_request_t));
+	if (!task->queue) {
+		free(task);
+		return ESP_ERR_NO_MEM;
+	}
+	
+	// Start the task, then accept requests.
+	if (xTaskCreate(nt3h2111_task_main, "nt3h2111", 3072, task, priority, NULL) != pdPASS) {
+		vQueueDelete(task->queue);
+		free(task);
+		return ESP_ERR_NO_MEM;
+	}
+	portENTER_CRITICAL(&nt3h2111_task_mux);
+	device->task = task;
+	portEXIT_CRITICAL(&nt3h2111_task_mux);
+	return ESP_OK;
+}
+
+// Queue a request for the driver task and wait for it to complete.
+static esp_err_t nt3h2111_task_request(struct nt3h2111_task *task, nt3h2111_request_t req, TickType_t timeout) {
+	if (!task) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	StaticSemaphore_t done;
+	esp_err_t         res = ESP_OK;
+	req.done   = xSemaphoreCreateBinaryStatic(&done);
+	req.result = &res;
+	if (!xQueueSend(task->queue, &req, timeout)) {
+		vSemaphoreDelete(req.done);
+		return ESP_ERR_TIMEOUT;
+	}
+	
+	// The driver task uses `res` and the data buffer until it gives the semaphore.
+	xSemaphoreTake(req.done, portMAX_DELAY);
+	vSemaphoreDelete(req.done);
+	return res;
+}
+
+// Queue a request for the driver task of a device, keeping its queue alive meanwhile.
+static esp_err_t nt3h2111_task_call(NT3H2111 *device, nt3h2111_request_t req, TickType_t timeout) {
+	portENTER_CRITICAL(&nt3h2111_task_mux);
+	struct nt3h2111_task *task = device->task;
+	if (task) task->users++;
+	portEXIT_CRITICAL(&nt3h2111_task_mux);
+	if (!task) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	
+	esp_err_t res = nt3h2111_task_request(task, req, timeout);
+	portENTER_CRITICAL(&nt3h2111_task_mux);
+	task->users--;
+	portEXIT_CRITICAL(&nt3h2111_task_mux);
+	return res;
+}
+
+// Stop the driver task after it has served the requests queued before this call.
+esp_err_t nt3h2111_task_stop(NT3H2111 *device) {
+	// Refuse new requests.
+	portENTER_CRITICAL(&nt3h2111_task_mux);
+	struct nt3h2111_task *task = device->task;
+	device->task = NULL;
+	portEXIT_CRITICAL(&nt3h2111_task_mux);
+	if (!task) return ESP_OK;
+	
+	// Let the task finish the requests queued before the stop request.
+	nt3h2111_request_t req = { .data = NULL };
+	esp_err_t res = nt3h2111_task_request(task, req, portMAX_DELAY);
+	
+	// Fail later requests until no caller uses the queue any more.
+	while (1) {
+		while (xQueueReceive(task->queue, &req, 0)) {
+			nt3h2111_task_done(&req, ESP_ERR_INVALID_STATE);
+		}
+		portENTER_CRITICAL(&nt3h2111_task_mux);
+		size_t users = task->users;
+		portEXIT_CRITICAL(&nt3h2111_task_mux);
+		if (!users) break;
+		vTaskDelay(1);
+	}
+	vQueueDelete(task->queue);
+	free(task);
+	return res;
+}
+
+// Unaligned raw read through the driver task.
+esp_err_t nt3h2111_task_read(NT3H2111 *device, uint16_t offset, uint16_t len, uint8_t data[], TickType_t timeout) {
+	// Bounds check.
+	if (offset + len > NT3H2111_RAW_LEN) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	if (!len) return ESP_OK;
+	
+	nt3h2111_request_t req = {
+		.offset = offset,
+		.len    = len,
+		.write  = false,
+		.data   = data,
+	};
+	return nt3h2111_task_call(device, req, timeout);
+}
+
+// Unaligned raw write through the driver task.
+esp_err_t nt3h2111_task_write(NT3H2111 *device, uint16_t offset, uint16_t len, const uint8_t data[], TickType_t timeout) {
+	// Bounds check.
+	if (offset + len > NT3H2111_RAW_LEN) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	if (!len) return ESP_OK;
+	
+	nt3h2111_request_t req = {
+		.offset = offset,
+		.len    = len,
+		.write  = true,
+		.data   = (uint8_t *) data,
+	};
+	return nt3h2111_task_call(device, req, timeout);
+}